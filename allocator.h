@@ -1,139 +1,1205 @@
 #ifndef __ALLOCATOR_H__
 #define __ALLOCATOR_H__
 
+#include <stddef.h>
 #include <stdlib.h>
-#include <new.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <new>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <type_traits>
 
-template<int base>
+#ifndef ALLOCATOR_HUGE_PAGES
+#define ALLOCATOR_HUGE_PAGES 0
+#endif
+
+/*
+ *    Every thread keeps its own free list per size class and only touches
+ *    the shared pool, one mutex per class, to move FILL_CNT objects at a
+ *    time (fewer for classes above CHUNK_SIZE / 4 / FILL_CNT): a thread
+ *    fetches a batch when its list runs empty and gives a batch back once
+ *    it holds more than two. A thread's remaining objects go back to the
+ *    pool when it exits.
+ *
+ *    void* p = Allocator<16, GeometricClasses<16> >::alloc(3000);
+ *
+ *    The size classes are a compile-time policy. LinearClasses<base, n>,
+ *    the default, has n classes at multiples of base. GeometricClasses
+ *    <base, steps, max> has steps classes per power of two up to max, so
+ *    no object wastes more than about 1 / steps of its size; a constexpr
+ *    table maps a size to its class in one lookup. The chunk grows to at
+ *    least 8 times the largest class. GeometricClasses needs C++14.
+ *
+ *    Objects carry no header. Each CHUNK_SIZE aligned chunk holds objects
+ *    of one class behind a small chunk header, and a two-level map from
+ *    chunk number to class tells free where a pointer belongs; pointers
+ *    that are in no chunk came from malloc, or posix_memalign where base
+ *    is above alignof(max_align_t). Objects are aligned to base, chunk
+ *    addresses are assumed to fit in 48 bits.
+ *
+ *    The pool keeps the free objects on their chunks. A chunk whose
+ *    objects have all come back is idle; idle chunks beyond the retain
+ *    limit of their class are unmapped at once, trim() unmaps all of them
+ *    after flushing the calling thread's lists. The limit is in bytes,
+ *    1 MiB per class unless set_retain() changes it, whatever the chunk
+ *    size of the class policy.
+ *
+ *    With set_huge_pages(true), or ALLOCATOR_HUGE_PAGES defined to 1,
+ *    new chunks are carved out of 2 MiB aligned regions advised with
+ *    MADV_HUGEPAGE, so neighbouring chunks share a TLB entry; where the
+ *    kernel has no transparent hugepages the regions are used as plain
+ *    pages. Regions are never unmapped: a chunk given back from one keeps
+ *    its first page, drops the rest with MADV_DONTNEED (which splits the
+ *    hugepage) and is reused before any new memory is mapped.
+ *
+ *    Threads count their own allocs and frees per class, the pool counts
+ *    its chunks and free objects under the class locks; snapshot() adds
+ *    them up and dump() prints them. Requests above the largest class go
+ *    to malloc and are counted apart. set_sampler(hook, n) calls hook
+ *    with the caller's return address on one alloc in n per thread.
+ *
+ *    std::list<int, PoolAllocator<int> > l;
+ *
+ *    Node* n = ObjectPool<Node>::construct(1, 2);
+ *    ObjectPool<Node>::destroy(n);
+ *
+ *    ObjectPool works out the size class of T at compile time and goes
+ *    straight to that class's list.
+ *
+ *    Arena<16> arena;
+ *    {
+ *        Arena<16>::Scope scope(arena);
+ *        char* tmp = (char*)arena.alloc(100);
+ *    }
+ *    arena.reset();
+ *
+ *    An Arena bump-allocates from chunks of the same size as the pool's,
+ *    free is a no-op. rewind() drops everything allocated after a marker,
+ *    reset() drops everything; the chunks are kept for reuse until the
+ *    arena is destroyed. An arena is not shared between threads.
+ */
+
+constexpr size_t floor_pow_2(size_t size) {
+    return size < 2 ? 1 : 2 * floor_pow_2(size / 2);
+}
+
+constexpr size_t geometric_next(size_t size, size_t base, size_t steps) {
+    return (size + (floor_pow_2(size) / steps < base ? base : floor_pow_2(size) / steps) + base - 1) / base * base;
+}
+
+constexpr size_t geometric_count(size_t size, size_t base, size_t steps, size_t max) {
+    return size >= max ? 1 : 1 + geometric_count(geometric_next(size, base, steps), base, steps, max);
+}
+
+constexpr int chunk_bits(size_t max_size, int bits = 16) {
+    return ((size_t)1 << bits) >= max_size * 8 ? bits : chunk_bits(max_size, bits + 1);
+}
+
+template<int base, int count = 16>
+struct LinearClasses {
+    enum {
+        SIZE_TYPE = count,
+        MAX_SIZE = base * count
+    };
+
+    static constexpr size_t size(size_t idx) {
+        return (idx + 1) * base;
+    }
+
+    static constexpr size_t locate(size_t size) {
+        return (size + base - 1) / base - 1;
+    }
+};
+
+#if __cplusplus >= 201402L
+template<int base, int steps, int max>
+struct GeometricTable {
+    enum {
+        SIZE_TYPE = geometric_count(base, base, steps, max)
+    };
+
+    constexpr GeometricTable() : sizes(), index() {
+        size_t idx = 0;
+        size_t size = base;
+        for (size_t i = 0; i < max / base; ++i) {
+            if ((i + 1) * base > size) {
+                sizes[idx++] = size;
+                size = geometric_next(size, base, steps);
+                size = size < max ? size : max;
+            }
+
+            index[i] = (unsigned char)idx;
+        }
+
+        sizes[idx] = max;
+    }
+
+    size_t sizes[SIZE_TYPE];
+    unsigned char index[max / base];
+};
+
+template<int base, int steps = 4, int max = 32768>
+struct GeometricClasses {
+    enum {
+        SIZE_TYPE = GeometricTable<base, steps, max>::SIZE_TYPE,
+        MAX_SIZE = max
+    };
+
+    static_assert(max % base == 0, "max must be a multiple of base");
+    static_assert(SIZE_TYPE < 255, "too many size classes");
+
+    static constexpr size_t size(size_t idx) {
+        return _table.sizes[idx];
+    }
+
+    static constexpr size_t locate(size_t size) {
+        return _table.index[(size + base - 1) / base - 1];
+    }
+
+    static constexpr GeometricTable<base, steps, max> _table = GeometricTable<base, steps, max>();
+};
+
+template<int base, int steps, int max>
+constexpr GeometricTable<base, steps, max> GeometricClasses<base, steps, max>::_table;
+#endif
+
+template<int base, typename Classes = LinearClasses<base> >
 class Allocator {
 public:
     static void* alloc(size_t size);
     static void free(void* p);
 
+    static void trim();
+    static void set_retain(size_t bytes);
+    static void set_huge_pages(bool on);
+
+    struct ClassStats {
+        size_t size;
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t live;
+        size_t cached;
+        size_t pooled;
+        size_t chunk_bytes;
+    };
+
+    struct Snapshot {
+        ClassStats classes[Classes::SIZE_TYPE];
+        uint64_t large_allocs;
+        uint64_t large_frees;
+        uint64_t large_bytes;
+    };
+
+    typedef void (*Sampler)(void* p, size_t size, void* caller);
+
+    static Snapshot snapshot();
+    static void dump(FILE* out);
+    static void set_sampler(Sampler sampler, size_t period);
+
 private:
+    template<typename T, int, typename> friend class ObjectPool;
+    template<int> friend class Arena;
+
     enum {
-        SIZE_TYPE = 16,
-        FILL_CNT = 20
+        SIZE_TYPE = Classes::SIZE_TYPE,
+        FILL_CNT = 20,
+        CHUNK_BITS = chunk_bits(Classes::MAX_SIZE),
+        CHUNK_SIZE = 1 << CHUNK_BITS,
+        MAP_BITS = 16,
+        MAP_SIZE = 1 << MAP_BITS,
+        LEAF_BITS = 48 - CHUNK_BITS - MAP_BITS,
+        LEAF_SIZE = 1 << LEAF_BITS,
+        RETAIN_SIZE = 1 << 20,
+        RESAMPLE_CNT = 1 << 16,
+        PAGE_SIZE = 4096,
+        HUGE_PAGE_SIZE = 1 << 21,
+        REGION_SIZE = CHUNK_SIZE > HUGE_PAGE_SIZE ? CHUNK_SIZE : HUGE_PAGE_SIZE,
+        MAX_REGIONS = 4096
     };
 
+    static_assert(!(base & (base - 1)), "base must be a power of 2");
+    static_assert(Classes::MAX_SIZE % base == 0, "size classes must be multiples of base");
+    static_assert(SIZE_TYPE < 255, "a class must fit in a map byte");
+
     union obj {
         obj* _next;
         char data[1];
     };
 
+    struct chunk {
+        chunk* _prev;
+        chunk* _next;
+        obj* _free;
+        char* _top;
+        char* _end;
+        size_t _used;
+        size_t _idx;
+    };
+
+    struct Cache {
+        Cache();
+        ~Cache();
+
+        obj* _list[SIZE_TYPE];
+        size_t _count[SIZE_TYPE];
+        size_t _sample;
+        Cache* _prev;
+        Cache* _next;
+        std::atomic<uint64_t> _allocs[SIZE_TYPE + 1];
+        std::atomic<uint64_t> _frees[SIZE_TYPE + 1];
+        std::atomic<uint64_t> _large_bytes;
+    };
+
     static size_t _round_up(size_t size);
-    static size_t _locate(size_t size);
-    static size_t _demodulate(void*& p);
-    static void* _modulate(void* p, size_t size);
-    static void* fill_n(size_t unit_size, size_t n);
-
-    static char* _begin;
-    static char* _end;
-    static obj* _list[SIZE_TYPE];
+    static size_t _batch(size_t idx);
+    static size_t _class_of(void* p);
+    static chunk* _chunk_of(void* p);
+    static bool _is_full(chunk* c, size_t unit_size);
+    static void _link(chunk*& head, chunk* c);
+    static void _unlink(chunk*& head, chunk* c);
+    static char* _map_aligned(size_t size);
+    static char* _map_chunk();
+    static void _unmap_chunk(char* p);
+    static bool _in_region(const char* p);
+    static chunk* _new_chunk(size_t idx);
+    static void _delete_chunk(chunk* c);
+    static obj* fill_n(size_t unit_size, size_t n);
+    static void _fetch(Cache& cache, size_t idx);
+    static void _release(Cache& cache, size_t idx, size_t n);
+    static void* _alloc(size_t idx);
+    static void _free(void* p, size_t idx);
+    static void _count(std::atomic<uint64_t>& counter, uint64_t n);
+    static void _sample(Cache& cache, void* p, size_t size, void* caller);
+
+    static std::mutex _chunk_mutex;
+    static std::atomic<unsigned char*> _map[MAP_SIZE];
+    static std::mutex _region_mutex;
+    static std::atomic<bool> _huge;
+    static char* _region_top;
+    static char* _region_end;
+    static char* _regions[MAX_REGIONS];
+    static size_t _region_count;
+    static char* _spare;
+    static std::atomic<size_t> _retain;
+    static chunk* _partial[SIZE_TYPE];
+    static chunk* _idle[SIZE_TYPE];
+    static size_t _idle_size[SIZE_TYPE];
+    static std::mutex _list_mutex[SIZE_TYPE];
+    static size_t _used[SIZE_TYPE];
+    static size_t _pooled[SIZE_TYPE];
+    static size_t _chunks[SIZE_TYPE];
+    static std::mutex _stats_mutex;
+    static Cache* _caches;
+    static uint64_t _retired_allocs[SIZE_TYPE + 1];
+    static uint64_t _retired_frees[SIZE_TYPE + 1];
+    static uint64_t _retired_large_bytes;
+    static std::atomic<Sampler> _sampler;
+    static std::atomic<size_t> _period;
+    static thread_local Cache _cache;
 };
 
-template<int base>
-char* Allocator<base>::_begin = 0;
+template<int base, typename Classes>
+std::mutex Allocator<base, Classes>::_chunk_mutex;
 
-template<int base>
-char* Allocator<base>::_end = 0;
+template<int base, typename Classes>
+std::atomic<unsigned char*> Allocator<base, Classes>::_map[MAP_SIZE];
 
-template<int base>
-typename Allocator<base>::obj* Allocator<base>::_list[SIZE_TYPE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+template<int base, typename Classes>
+std::mutex Allocator<base, Classes>::_region_mutex;
 
-template<int base>
-size_t Allocator<base>::_round_up(size_t size) {
+template<int base, typename Classes>
+std::atomic<bool> Allocator<base, Classes>::_huge(ALLOCATOR_HUGE_PAGES);
+
+template<int base, typename Classes>
+char* Allocator<base, Classes>::_region_top = 0;
+
+template<int base, typename Classes>
+char* Allocator<base, Classes>::_region_end = 0;
+
+template<int base, typename Classes>
+char* Allocator<base, Classes>::_regions[MAX_REGIONS] = { 0 };
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_region_count = 0;
+
+template<int base, typename Classes>
+char* Allocator<base, Classes>::_spare = 0;
+
+template<int base, typename Classes>
+std::atomic<size_t> Allocator<base, Classes>::_retain(RETAIN_SIZE);
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::chunk* Allocator<base, Classes>::_partial[SIZE_TYPE] = { 0 };
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::chunk* Allocator<base, Classes>::_idle[SIZE_TYPE] = { 0 };
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_idle_size[SIZE_TYPE] = { 0 };
+
+template<int base, typename Classes>
+std::mutex Allocator<base, Classes>::_list_mutex[SIZE_TYPE];
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_used[SIZE_TYPE] = { 0 };
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_pooled[SIZE_TYPE] = { 0 };
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_chunks[SIZE_TYPE] = { 0 };
+
+template<int base, typename Classes>
+std::mutex Allocator<base, Classes>::_stats_mutex;
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::Cache* Allocator<base, Classes>::_caches = 0;
+
+template<int base, typename Classes>
+uint64_t Allocator<base, Classes>::_retired_allocs[SIZE_TYPE + 1] = { 0 };
+
+template<int base, typename Classes>
+uint64_t Allocator<base, Classes>::_retired_frees[SIZE_TYPE + 1] = { 0 };
+
+template<int base, typename Classes>
+uint64_t Allocator<base, Classes>::_retired_large_bytes = 0;
+
+template<int base, typename Classes>
+std::atomic<typename Allocator<base, Classes>::Sampler> Allocator<base, Classes>::_sampler(0);
+
+template<int base, typename Classes>
+std::atomic<size_t> Allocator<base, Classes>::_period(0);
+
+template<int base, typename Classes>
+thread_local typename Allocator<base, Classes>::Cache Allocator<base, Classes>::_cache;
+
+template<int base, typename Classes>
+Allocator<base, Classes>::Cache::Cache() : _sample(1), _prev(0), _next(0), _large_bytes(0) {
+    for (size_t i = 0; i < SIZE_TYPE; ++i) {
+        _list[i] = 0;
+        _count[i] = 0;
+    }
+
+    for (size_t i = 0; i <= SIZE_TYPE; ++i) {
+        _allocs[i].store(0, std::memory_order_relaxed);
+        _frees[i].store(0, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _next = _caches;
+    if (_caches) {
+        _caches->_prev = this;
+    }
+
+    _caches = this;
+}
+
+template<int base, typename Classes>
+Allocator<base, Classes>::Cache::~Cache() {
+    for (size_t i = 0; i < SIZE_TYPE; ++i) {
+        if (_count[i] > 0) {
+            _release(*this, i, _count[i]);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    for (size_t i = 0; i <= SIZE_TYPE; ++i) {
+        _retired_allocs[i] += _allocs[i].load(std::memory_order_relaxed);
+        _retired_frees[i] += _frees[i].load(std::memory_order_relaxed);
+    }
+
+    _retired_large_bytes += _large_bytes.load(std::memory_order_relaxed);
+
+    if (_prev) {
+        _prev->_next = _next;
+    } else {
+        _caches = _next;
+    }
+
+    if (_next) {
+        _next->_prev = _prev;
+    }
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_count(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_round_up(size_t size) {
     return (size + base - 1) & ~(base - 1);
 }
 
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_batch(size_t idx) {
+    size_t n = CHUNK_SIZE / 4 / Classes::size(idx);
+    return n < 1 ? 1 : n < (size_t)FILL_CNT ? n : (size_t)FILL_CNT;
+}
+
+template<int base, typename Classes>
+size_t Allocator<base, Classes>::_class_of(void* p) {
+    uintptr_t chunk = (uintptr_t)p >> CHUNK_BITS;
+    uintptr_t top = chunk >> LEAF_BITS;
+    if (top >= MAP_SIZE) {
+        return SIZE_TYPE;
+    }
+
+    unsigned char* leaf = _map[top].load(std::memory_order_acquire);
+    if (!leaf || !leaf[chunk & (LEAF_SIZE - 1)]) {
+        return SIZE_TYPE;
+    }
+
+    return leaf[chunk & (LEAF_SIZE - 1)] - 1;
+}
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::chunk* Allocator<base, Classes>::_chunk_of(void* p) {
+    return (chunk*)((uintptr_t)p & ~(uintptr_t)(CHUNK_SIZE - 1));
+}
+
+template<int base, typename Classes>
+bool Allocator<base, Classes>::_is_full(chunk* c, size_t unit_size) {
+    return !c->_free && c->_top + unit_size > c->_end;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_link(chunk*& head, chunk* c) {
+    c->_prev = 0;
+    c->_next = head;
+    if (head) {
+        head->_prev = c;
+    }
+
+    head = c;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_unlink(chunk*& head, chunk* c) {
+    if (c->_prev) {
+        c->_prev->_next = c->_next;
+    } else {
+        head = c->_next;
+    }
+
+    if (c->_next) {
+        c->_next->_prev = c->_prev;
+    }
+
+    c->_prev = 0;
+    c->_next = 0;
+}
+
+template<int base, typename Classes>
+char* Allocator<base, Classes>::_map_aligned(size_t size) {
+    void* p = mmap(0, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+
+    char* begin = (char*)p;
+    char* aligned = (char*)(((uintptr_t)begin + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned > begin) {
+        munmap(begin, aligned - begin);
+    }
+
+    munmap(aligned + size, begin + size * 2 - (aligned + size));
+
+    return aligned;
+}
+
+template<int base, typename Classes>
+char* Allocator<base, Classes>::_map_chunk() {
+    {
+        std::lock_guard<std::mutex> lock(_region_mutex);
+        if (_spare) {
+            char* p = _spare;
+            _spare = *(char**)p;
+            return p;
+        }
+
+        if (_region_top == _region_end && _huge.load(std::memory_order_relaxed) && _region_count < MAX_REGIONS) {
+            char* region = _map_aligned(REGION_SIZE);
+            if (region) {
+#ifdef MADV_HUGEPAGE
+                madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+                char** pos = std::upper_bound(_regions, _regions + _region_count, region);
+                std::copy_backward(pos, _regions + _region_count, _regions + _region_count + 1);
+                *pos = region;
+                ++_region_count;
+
+                _region_top = region;
+                _region_end = region + REGION_SIZE;
+            }
+        }
+
+        if (_region_top < _region_end) {
+            char* p = _region_top;
+            _region_top += CHUNK_SIZE;
+            return p;
+        }
+    }
+
+    return _map_aligned(CHUNK_SIZE);
+}
+
+template<int base, typename Classes>
+bool Allocator<base, Classes>::_in_region(const char* p) {
+    char* region = (char*)((uintptr_t)p & ~(uintptr_t)(REGION_SIZE - 1));
+    return std::binary_search(_regions, _regions + _region_count, region);
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_unmap_chunk(char* p) {
+    std::lock_guard<std::mutex> lock(_region_mutex);
+    if (!_in_region(p)) {
+        munmap(p, CHUNK_SIZE);
+        return;
+    }
+
+    madvise(p + PAGE_SIZE, CHUNK_SIZE - PAGE_SIZE, MADV_DONTNEED);
+    *(char**)p = _spare;
+    _spare = p;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::set_huge_pages(bool on) {
+    _huge.store(on, std::memory_order_relaxed);
+}
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::chunk* Allocator<base, Classes>::_new_chunk(size_t idx) {
+    char* p = _map_chunk();
+    if (!p) {
+        return 0;
+    }
+
+    uintptr_t number = (uintptr_t)p >> CHUNK_BITS;
+    uintptr_t top = number >> LEAF_BITS;
+    unsigned char* leaf = 0;
+    if (top < MAP_SIZE) {
+        std::lock_guard<std::mutex> lock(_chunk_mutex);
+        leaf = _map[top].load(std::memory_order_relaxed);
+        if (!leaf) {
+            leaf = (unsigned char*)calloc(LEAF_SIZE, 1);
+            if (leaf) {
+                _map[top].store(leaf, std::memory_order_release);
+            }
+        }
+
+        if (leaf) {
+            leaf[number & (LEAF_SIZE - 1)] = (unsigned char)(idx + 1);
+        }
+    }
+
+    if (!leaf) {
+        _unmap_chunk(p);
+        return 0;
+    }
+
+    ++_chunks[idx];
+
+    chunk* c = (chunk*)p;
+    c->_prev = 0;
+    c->_next = 0;
+    c->_free = 0;
+    c->_top = p + _round_up(sizeof(chunk));
+    c->_end = p + CHUNK_SIZE;
+    c->_used = 0;
+    c->_idx = idx;
+
+    return c;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_delete_chunk(chunk* c) {
+    char* first = (char*)c + _round_up(sizeof(chunk));
+    _pooled[c->_idx] -= (c->_top - first) / Classes::size(c->_idx);
+    --_chunks[c->_idx];
+
+    uintptr_t number = (uintptr_t)c >> CHUNK_BITS;
+    {
+        std::lock_guard<std::mutex> lock(_chunk_mutex);
+        unsigned char* leaf = _map[number >> LEAF_BITS].load(std::memory_order_relaxed);
+        leaf[number & (LEAF_SIZE - 1)] = 0;
+    }
+
+    _unmap_chunk((char*)c);
+}
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::obj* Allocator<base, Classes>::fill_n(size_t unit_size, size_t n) {
+    size_t idx = Classes::locate(unit_size);
+    obj* head = 0;
+    size_t got = 0;
+
+    while (got < n) {
+        chunk* c = _partial[idx];
+        if (!c) {
+            c = _idle[idx];
+            if (c) {
+                _unlink(_idle[idx], c);
+                _idle_size[idx] -= CHUNK_SIZE;
+            } else {
+                c = _new_chunk(idx);
+                if (!c) {
+                    break;
+                }
+            }
+
+            _link(_partial[idx], c);
+        }
+
+        while (got < n) {
+            obj* cur = c->_free;
+            if (cur) {
+                c->_free = cur->_next;
+                --_pooled[idx];
+            } else if (c->_top + unit_size <= c->_end) {
+                cur = (obj*)c->_top;
+                c->_top += unit_size;
+            } else {
+                break;
+            }
+
+            cur->_next = head;
+            head = cur;
+            ++c->_used;
+            ++got;
+        }
+
+        if (_is_full(c, unit_size)) {
+            _unlink(_partial[idx], c);
+        }
+    }
+
+    _used[idx] += got;
+
+    return head;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_fetch(Cache& cache, size_t idx) {
+    std::lock_guard<std::mutex> lock(_list_mutex[idx]);
+
+    obj* head = fill_n(Classes::size(idx), _batch(idx));
+    size_t n = 0;
+    for (obj* cur = head; cur; cur = cur->_next) {
+        ++n;
+    }
+
+    cache._list[idx] = head;
+    cache._count[idx] = n;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_release(Cache& cache, size_t idx, size_t n) {
+    obj* head = cache._list[idx];
+    obj* last = head;
+    for (size_t i = 1; i < n; ++i) {
+        last = last->_next;
+    }
+
+    cache._list[idx] = last->_next;
+    cache._count[idx] -= n;
+    last->_next = 0;
+
+    size_t unit_size = Classes::size(idx);
+    size_t retain = _retain.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(_list_mutex[idx]);
+    _used[idx] -= n;
+    _pooled[idx] += n;
+    while (head) {
+        obj* cur = head;
+        head = head->_next;
+
+        chunk* c = _chunk_of(cur);
+        if (_is_full(c, unit_size)) {
+            _link(_partial[idx], c);
+        }
+
+        cur->_next = c->_free;
+        c->_free = cur;
+
+        if (--c->_used == 0) {
+            _unlink(_partial[idx], c);
+            if (_idle_size[idx] + CHUNK_SIZE > retain) {
+                _delete_chunk(c);
+            } else {
+                _link(_idle[idx], c);
+                _idle_size[idx] += CHUNK_SIZE;
+            }
+        }
+    }
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::trim() {
+    Cache& cache = _cache;
+    for (size_t idx = 0; idx < SIZE_TYPE; ++idx) {
+        if (cache._count[idx] > 0) {
+            _release(cache, idx, cache._count[idx]);
+        }
+
+        std::lock_guard<std::mutex> lock(_list_mutex[idx]);
+        while (_idle[idx]) {
+            chunk* c = _idle[idx];
+            _unlink(_idle[idx], c);
+            _idle_size[idx] -= CHUNK_SIZE;
+            _delete_chunk(c);
+        }
+    }
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::set_retain(size_t bytes) {
+    _retain.store(bytes, std::memory_order_relaxed);
+}
+
+template<int base, typename Classes>
+typename Allocator<base, Classes>::Snapshot Allocator<base, Classes>::snapshot() {
+    Snapshot snap;
+    uint64_t allocs[SIZE_TYPE + 1];
+    uint64_t frees[SIZE_TYPE + 1];
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        for (size_t i = 0; i <= SIZE_TYPE; ++i) {
+            allocs[i] = _retired_allocs[i];
+            frees[i] = _retired_frees[i];
+        }
+
+        snap.large_bytes = _retired_large_bytes;
+        for (Cache* cache = _caches; cache; cache = cache->_next) {
+            for (size_t i = 0; i <= SIZE_TYPE; ++i) {
+                allocs[i] += cache->_allocs[i].load(std::memory_order_relaxed);
+                frees[i] += cache->_frees[i].load(std::memory_order_relaxed);
+            }
+
+            snap.large_bytes += cache->_large_bytes.load(std::memory_order_relaxed);
+        }
+    }
+
+    for (size_t idx = 0; idx < SIZE_TYPE; ++idx) {
+        ClassStats& stats = snap.classes[idx];
+        stats.size = Classes::size(idx);
+        stats.allocs = allocs[idx];
+        stats.frees = frees[idx];
+        stats.live = allocs[idx] > frees[idx] ? allocs[idx] - frees[idx] : 0;
+
+        std::lock_guard<std::mutex> lock(_list_mutex[idx]);
+        stats.cached = _used[idx] > stats.live ? _used[idx] - stats.live : 0;
+        stats.pooled = _pooled[idx];
+        stats.chunk_bytes = _chunks[idx] * CHUNK_SIZE;
+    }
+
+    snap.large_allocs = allocs[SIZE_TYPE];
+    snap.large_frees = frees[SIZE_TYPE];
+
+    return snap;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::dump(FILE* out) {
+    Snapshot snap = snapshot();
+    fprintf(out, "%8s %12s %12s %12s %10s %10s %12s\n", "size", "allocs", "frees", "live", "cached", "pooled", "chunk_bytes");
+    for (size_t idx = 0; idx < SIZE_TYPE; ++idx) {
+        const ClassStats& stats = snap.classes[idx];
+        fprintf(out, "%8zu %12llu %12llu %12llu %10zu %10zu %12zu\n", stats.size,
+            (unsigned long long)stats.allocs, (unsigned long long)stats.frees, (unsigned long long)stats.live,
+            stats.cached, stats.pooled, stats.chunk_bytes);
+    }
+
+    fprintf(out, "%8s %12llu %12llu %12llu bytes requested %llu\n", "large",
+        (unsigned long long)snap.large_allocs, (unsigned long long)snap.large_frees,
+        (unsigned long long)(snap.large_allocs - snap.large_frees), (unsigned long long)snap.large_bytes);
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::set_sampler(Sampler sampler, size_t period) {
+    _period.store(sampler ? period : 0, std::memory_order_relaxed);
+    _sampler.store(sampler, std::memory_order_release);
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_sample(Cache& cache, void* p, size_t size, void* caller) {
+    size_t period = _period.load(std::memory_order_relaxed);
+    cache._sample = period ? period : (size_t)RESAMPLE_CNT;
+
+    Sampler sampler = _sampler.load(std::memory_order_acquire);
+    if (sampler && period && p) {
+        sampler(p, size, caller);
+    }
+}
+
+template<int base, typename Classes>
+void* Allocator<base, Classes>::alloc(size_t size) {
+    void* p = 0;
+    if (size > Classes::MAX_SIZE) {
+        if ((size_t)base <= alignof(max_align_t)) {
+            p = malloc(size);
+        } else if (posix_memalign(&p, base, size) != 0) {
+            p = 0;
+        }
+
+        _count(_cache._allocs[SIZE_TYPE], 1);
+        _count(_cache._large_bytes, size);
+    } else {
+        p = _alloc(Classes::locate(size ? size : 1));
+    }
+
+    Cache& cache = _cache;
+    if (--cache._sample == 0) {
+#if defined(__GNUC__)
+        _sample(cache, p, size, __builtin_return_address(0));
+#else
+        _sample(cache, p, size, 0);
+#endif
+    }
+
+    return p;
+}
+
+template<int base, typename Classes>
+void* Allocator<base, Classes>::_alloc(size_t idx) {
+    Cache& cache = _cache;
+    if (!cache._list[idx]) {
+        _fetch(cache, idx);
+        if (!cache._list[idx]) {
+            return 0;
+        }
+    }
+
+    obj* cur = cache._list[idx];
+    cache._list[idx] = cur->_next;
+    --cache._count[idx];
+    _count(cache._allocs[idx], 1);
+    return (void*)cur;
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::free(void* p) {
+    if (!p) {
+        return;
+    }
+
+    size_t idx = _class_of(p);
+    if (idx >= SIZE_TYPE) {
+        _count(_cache._frees[SIZE_TYPE], 1);
+        ::free(p);
+    } else {
+        _free(p, idx);
+    }
+}
+
+template<int base, typename Classes>
+void Allocator<base, Classes>::_free(void* p, size_t idx) {
+    Cache& cache = _cache;
+    obj* pre = cache._list[idx];
+    cache._list[idx] = (obj*)p;
+    cache._list[idx]->_next = pre;
+    _count(cache._frees[idx], 1);
+    if (++cache._count[idx] > _batch(idx) * 2) {
+        _release(cache, idx, _batch(idx));
+    }
+}
+
+template<typename T, int base = 16, typename Classes = LinearClasses<base> >
+class PoolAllocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::true_type is_always_equal;
+
+    template<typename U>
+    struct rebind {
+        typedef PoolAllocator<U, base, Classes> other;
+    };
+
+    PoolAllocator() noexcept;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U, base, Classes>&) noexcept;
+
+    T* allocate(size_t n);
+    void deallocate(T* p, size_t n);
+};
+
+template<typename T, int base, typename Classes>
+PoolAllocator<T, base, Classes>::PoolAllocator() noexcept {
+
+}
+
+template<typename T, int base, typename Classes>
+template<typename U>
+PoolAllocator<T, base, Classes>::PoolAllocator(const PoolAllocator<U, base, Classes>&) noexcept {
+
+}
+
+template<typename T, int base, typename Classes>
+T* PoolAllocator<T, base, Classes>::allocate(size_t n) {
+    static_assert(alignof(T) <= base, "T is over-aligned for this base");
+
+    if (n > (size_t)-1 / sizeof(T)) {
+        throw std::bad_alloc();
+    }
+
+    void* p = Allocator<base, Classes>::alloc(n * sizeof(T));
+    if (!p) {
+        throw std::bad_alloc();
+    }
+
+    return (T*)p;
+}
+
+template<typename T, int base, typename Classes>
+void PoolAllocator<T, base, Classes>::deallocate(T* p, size_t) {
+    Allocator<base, Classes>::free(p);
+}
+
+template<typename T, typename U, int base, typename Classes>
+bool operator==(const PoolAllocator<T, base, Classes>&, const PoolAllocator<U, base, Classes>&) {
+    return true;
+}
+
+template<typename T, typename U, int base, typename Classes>
+bool operator!=(const PoolAllocator<T, base, Classes>&, const PoolAllocator<U, base, Classes>&) {
+    return false;
+}
+
+template<typename T, int base = 16, typename Classes = LinearClasses<base> >
+class ObjectPool {
+public:
+    template<typename... Args>
+    static T* construct(Args&&... args);
+    static void destroy(T* p);
+
+private:
+    enum {
+        CLASS = sizeof(T) <= Classes::MAX_SIZE ? Classes::locate(sizeof(T)) : (size_t)Classes::SIZE_TYPE
+    };
+
+    static_assert((size_t)CLASS < (size_t)Classes::SIZE_TYPE, "T is too large for the size classes");
+    static_assert(alignof(T) <= base, "T is over-aligned for this base");
+};
+
+template<typename T, int base, typename Classes>
+template<typename... Args>
+T* ObjectPool<T, base, Classes>::construct(Args&&... args) {
+    void* p = Allocator<base, Classes>::_alloc(CLASS);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+
+    try {
+        return new (p) T(std::forward<Args>(args)...);
+    } catch (...) {
+        Allocator<base, Classes>::_free(p, CLASS);
+        throw;
+    }
+}
+
+template<typename T, int base, typename Classes>
+void ObjectPool<T, base, Classes>::destroy(T* p) {
+    if (p) {
+        p->~T();
+        Allocator<base, Classes>::_free(p, CLASS);
+    }
+}
+
+template<int base = 16>
+class Arena {
+private:
+    struct block;
+
+public:
+    struct Marker {
+        block* _block;
+        char* _top;
+    };
+
+    class Scope {
+    public:
+        Scope(Arena& arena);
+        ~Scope();
+
+    private:
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+
+        Arena& _arena;
+        Marker _marker;
+    };
+
+    Arena();
+    ~Arena();
+
+    void* alloc(size_t size);
+    void free(void* p);
+
+    Marker mark() const;
+    void rewind(const Marker& marker);
+    void reset();
+
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    enum {
+        CHUNK_SIZE = Allocator<base>::CHUNK_SIZE
+    };
+
+    struct block {
+        block* _prev;
+        char* _top;
+        char* _end;
+        size_t _size;
+    };
+
+    static size_t _round_up(size_t size);
+    block* _new_block(size_t size);
+    void _drop(block* b);
+    void _unmap(block* b);
+
+    block* _head;
+    block* _spare;
+};
+
 template<int base>
-size_t Allocator<base>::_locate(size_t size) {
-    return (size + base - 1) / base - 1;
+Arena<base>::Scope::Scope(Arena& arena) : _arena(arena), _marker(arena.mark()) {
+
 }
 
 template<int base>
-size_t Allocator<base>::_demodulate(void*& p) {
-    unsigned char*& cur = (unsigned char*&)p;
-    --cur;
-    return *cur;
+Arena<base>::Scope::~Scope() {
+    _arena.rewind(_marker);
 }
 
 template<int base>
-void* Allocator<base>::_modulate(void* p, size_t size) {
-    unsigned char* cur = (unsigned char*)p;
-    unsigned char index = (unsigned char)_locate(size);
-    *cur = index >= SIZE_TYPE ? UCHAR_MAX : index;
-    ++cur;
-    return (void*)cur;
+Arena<base>::Arena() : _head(0), _spare(0) {
+
 }
 
 template<int base>
-void* Allocator<base>::fill_n(size_t unit_size, size_t n) {
-    size_t free_size = _end - _begin;
-    size_t real_n = n;
-    if (n > free_size / unit_size) {
-        real_n = free_size / unit_size;
+Arena<base>::~Arena() {
+    reset();
+    while (_spare) {
+        block* b = _spare;
+        _spare = b->_prev;
+        _unmap(b);
     }
+}
 
-    if (real_n >= 1) {
-        size_t idx = _locate(unit_size);
+template<int base>
+size_t Arena<base>::_round_up(size_t size) {
+    return (size + base - 1) & ~(size_t)(base - 1);
+}
 
-        for (size_t i = 1; i < real_n; ++i) {
-            char* cur = _begin + i * unit_size;
-            obj* pre = _list[idx];
-            _list[idx] = (obj*)cur;
-            _list[idx]->_next = pre;
-        }
+template<int base>
+typename Arena<base>::block* Arena<base>::_new_block(size_t size) {
+    size_t header = _round_up(sizeof(block));
+    block* b = 0;
 
-        void* ret = (void*)_begin;
-        _begin += real_n * unit_size;
+    if (header + size <= CHUNK_SIZE) {
+        if (_spare) {
+            b = _spare;
+            _spare = b->_prev;
+        } else {
+            b = (block*)Allocator<base>::_map_chunk();
+            if (!b) {
+                return 0;
+            }
 
-        return _modulate((void*)ret, unit_size);
+            b->_size = CHUNK_SIZE;
+        }
     } else {
-        if (free_size > 0) {
-            size_t idx = _locate(free_size);
-            obj* pre = _list[idx];
-            _list[idx] = (obj*)_begin;
-            _list[idx]->_next = pre;
+        size_t length = (header + size + CHUNK_SIZE - 1) & ~(size_t)(CHUNK_SIZE - 1);
+        void* p = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return 0;
         }
 
-        size_t alloc_size = unit_size * n * 2;
-        _begin = (char*)malloc(alloc_size);
-        _end = _begin + alloc_size;
+        b = (block*)p;
+        b->_size = length;
+    }
+
+    b->_top = (char*)b + header;
+    b->_end = (char*)b + b->_size;
+    b->_prev = _head;
+    _head = b;
+
+    return b;
+}
 
-        return fill_n(unit_size, n);
+template<int base>
+void Arena<base>::_unmap(block* b) {
+    if (b->_size == CHUNK_SIZE) {
+        Allocator<base>::_unmap_chunk((char*)b);
+    } else {
+        munmap(b, b->_size);
     }
 }
 
 template<int base>
-void* Allocator<base>::alloc(size_t size) {
-    size_t real_size = size + 1;
-    size_t new_size = _round_up(real_size);
-    size_t max_size = base * SIZE_TYPE;
-    if (new_size > max_size) {
-        void* p = malloc(real_size);
-        return _modulate(p, UCHAR_MAX);
+void Arena<base>::_drop(block* b) {
+    if (b->_size == CHUNK_SIZE) {
+        b->_prev = _spare;
+        _spare = b;
     } else {
-        size_t idx = _locate(new_size);
-        obj* cur = _list[idx];
-        if (cur) {
-            _list[idx] = _list[idx]->_next;
-            return _modulate((void*)cur, new_size);
-        } else {
-            return fill_n(new_size, FILL_CNT);
+        _unmap(b);
+    }
+}
+
+template<int base>
+void* Arena<base>::alloc(size_t size) {
+    size = _round_up(size ? size : 1);
+    if (!_head || _head->_top + size > _head->_end) {
+        if (!_new_block(size)) {
+            return 0;
         }
     }
+
+    void* p = _head->_top;
+    _head->_top += size;
+    return p;
 }
 
 template<int base>
-void Allocator<base>::free(void* p) {
-    size_t idx = _demodulate(p);
-    if (idx >= SIZE_TYPE) {
-        free(p);
-    } else {
-        obj* pre = _list[idx];
-        _list[idx] = (obj*)p;
-        _list[idx]->_next = pre;
+void Arena<base>::free(void*) {
+
+}
+
+template<int base>
+typename Arena<base>::Marker Arena<base>::mark() const {
+    Marker marker;
+    marker._block = _head;
+    marker._top = _head ? _head->_top : 0;
+    return marker;
+}
+
+template<int base>
+void Arena<base>::rewind(const Marker& marker) {
+    while (_head && _head != marker._block) {
+        block* b = _head;
+        _head = b->_prev;
+        _drop(b);
     }
+
+    if (_head) {
+        _head->_top = marker._top;
+    }
+}
+
+template<int base>
+void Arena<base>::reset() {
+    Marker marker = { 0, 0 };
+    rewind(marker);
 }
 #endif
@@ -0,0 +1,91 @@
+/*
+ *    g++ -std=c++14 -O2 -I.. allocator_classes.cc -o allocator_classes
+ *
+ *    Size-class policies on a request mix shaped like a typical heap:
+ *    most requests are small, with a long tail up to 32 KiB (sizes are
+ *    2^x for x uniform in [3, 15], plus a random fraction of that). For
+ *    every policy it prints the share of requests that fall through to
+ *    malloc, the internal fragmentation of the ones the classes serve
+ *    (bytes of class size not asked for, over class bytes), and ns per
+ *    alloc/free pair when a window of live objects is replaced at random.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "../allocator.h"
+
+enum {
+    REQUESTS = 1 << 16,
+    WINDOW = 4096,
+    STEPS = 4000000
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<size_t> requests() {
+    std::vector<size_t> sizes(REQUESTS);
+    unsigned seed = 1;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        size_t low = (size_t)1 << (3 + rand_r(&seed) % 13);
+        sizes[i] = low + rand_r(&seed) % low;
+    }
+
+    return sizes;
+}
+
+template<typename Classes>
+static void run(const char* name, const std::vector<size_t>& sizes) {
+    typedef Allocator<16, Classes> A;
+
+    size_t large = 0;
+    double asked = 0;
+    double given = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        if (sizes[i] > Classes::MAX_SIZE) {
+            ++large;
+        } else {
+            asked += sizes[i];
+            given += Classes::size(Classes::locate(sizes[i]));
+        }
+    }
+
+    std::vector<void*> live(WINDOW);
+    for (size_t i = 0; i < WINDOW; ++i) {
+        live[i] = A::alloc(sizes[i]);
+    }
+
+    unsigned seed = 2;
+    double start = now();
+    for (size_t i = 0; i < STEPS; ++i) {
+        size_t slot = rand_r(&seed) % WINDOW;
+        A::free(live[slot]);
+        live[slot] = A::alloc(sizes[i % REQUESTS]);
+        *(char*)live[slot] = 1;
+    }
+
+    double ns = (now() - start) * 1e9 / STEPS;
+    for (size_t i = 0; i < WINDOW; ++i) {
+        A::free(live[i]);
+    }
+
+    A::trim();
+    printf("%-22s %8d %9.1f%% %9.1f%% %9.1f\n", name, (int)Classes::SIZE_TYPE,
+        100.0 * large / sizes.size(), given > 0 ? 100.0 * (given - asked) / given : 0.0, ns);
+}
+
+int main() {
+    std::vector<size_t> sizes = requests();
+
+    printf("%-22s %8s %10s %10s %9s\n", "classes", "count", "to malloc", "wasted", "ns");
+    run<LinearClasses<16> >("Linear<16>", sizes);
+    run<LinearClasses<16, 128> >("Linear<16, 128>", sizes);
+    run<GeometricClasses<16, 2> >("Geometric<16, 2>", sizes);
+    run<GeometricClasses<16> >("Geometric<16, 4>", sizes);
+    run<GeometricClasses<16, 8> >("Geometric<16, 8>", sizes);
+
+    return 0;
+}
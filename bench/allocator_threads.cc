@@ -0,0 +1,82 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. allocator_threads.cc -o allocator_threads -pthread
+ *
+ *    Allocator<16> against glibc malloc from 1 to N threads (argv[1],
+ *    default twice the cpus). Each thread keeps a window of live objects
+ *    of 16..256 bytes and replaces a random one per step, so the caches
+ *    see both fresh fills and reuse. Prints ns per alloc/free pair.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../allocator.h"
+
+enum {
+    WINDOW = 1024,
+    STEPS = 2000000
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Pool {
+    static void* alloc(size_t size) { return Allocator<16>::alloc(size); }
+    static void free(void* p) { Allocator<16>::free(p); }
+};
+
+struct Malloc {
+    static void* alloc(size_t size) { return ::malloc(size); }
+    static void free(void* p) { ::free(p); }
+};
+
+template<typename A>
+static void work(unsigned seed) {
+    std::vector<void*> live(WINDOW);
+    for (size_t i = 0; i < WINDOW; ++i) {
+        live[i] = A::alloc(16 + rand_r(&seed) % 241);
+    }
+
+    for (size_t i = 0; i < STEPS; ++i) {
+        size_t slot = rand_r(&seed) % WINDOW;
+        A::free(live[slot]);
+        live[slot] = A::alloc(16 + rand_r(&seed) % 241);
+        *(char*)live[slot] = 1;
+    }
+
+    for (size_t i = 0; i < WINDOW; ++i) {
+        A::free(live[i]);
+    }
+}
+
+template<typename A>
+static double run(unsigned threads) {
+    double start = now();
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t) {
+        pool.push_back(std::thread(work<A>, t + 1));
+    }
+
+    for (size_t t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+
+    return (now() - start) * 1e9 / ((double)STEPS * threads);
+}
+
+int main(int argc, char** argv) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    unsigned max = argc > 1 ? (unsigned)atoi(argv[1]) : 2 * (cpus ? cpus : 1);
+
+    printf("%8s %12s %12s %8s\n", "threads", "malloc ns", "pool ns", "speedup");
+    for (unsigned threads = 1; threads <= max; threads *= 2) {
+        double m = run<Malloc>(threads);
+        double p = run<Pool>(threads);
+        printf("%8u %12.1f %12.1f %7.2fx\n", threads, m, p, m / p);
+    }
+
+    return 0;
+}
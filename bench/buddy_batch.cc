@@ -0,0 +1,78 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. buddy_batch.cc -o buddy_batch
+ *
+ *    alloc_n/free_n against alloc/free in a loop: batches of count blocks
+ *    of one size are allocated and then freed together, on an empty
+ *    level-22 arena and on one where every other unit is taken.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "../buddy.h"
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void fragment(Buddy& buddy, uint32_t level) {
+    for (uint32_t i = 0; i < (1u << (level - 1)); ++i) {
+        buddy.alloc(1);
+    }
+
+    for (uint32_t i = 0; i < (1u << (level - 1)); i += 2) {
+        buddy.free(i);
+    }
+}
+
+static double loop(Buddy& buddy, uint32_t size, size_t count, size_t rounds) {
+    std::vector<uint32_t> out(count);
+    double start = now();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = buddy.alloc(size);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            buddy.free(out[i]);
+        }
+    }
+
+    return (now() - start) * 1e9 / (rounds * count);
+}
+
+static double batch(Buddy& buddy, uint32_t size, size_t count, size_t rounds) {
+    std::vector<uint32_t> out(count);
+    double start = now();
+    for (size_t r = 0; r < rounds; ++r) {
+        size_t n = buddy.alloc_n(size, count, out.data());
+        buddy.free_n(out.data(), n);
+    }
+
+    return (now() - start) * 1e9 / (rounds * count);
+}
+
+int main() {
+    const uint32_t level = 22;
+    printf("%10s %6s %6s %12s %12s %8s\n", "arena", "size", "count", "loop ns", "batch ns", "speedup");
+    for (int fragmented = 0; fragmented < 2; ++fragmented) {
+        for (uint32_t size = 1; size <= 64; size *= 8) {
+            for (size_t count = 16; count <= 1024; count *= 4) {
+                Buddy a(level);
+                Buddy b(level);
+                if (fragmented) {
+                    fragment(a, level);
+                    fragment(b, level);
+                }
+
+                size_t rounds = 2000000 / count;
+                double x = loop(a, size, count, rounds);
+                double y = batch(b, size, count, rounds);
+                printf("%10s %6u %6zu %12.1f %12.1f %7.2fx\n", fragmented ? "fragmented" : "empty", size, count, x, y, x / y);
+            }
+        }
+    }
+
+    return 0;
+}
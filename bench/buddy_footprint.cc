@@ -0,0 +1,92 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. buddy_footprint.cc -o buddy_footprint
+ *
+ *    Metadata footprint and walk speed of the original four-state tree
+ *    (reference_buddy.h, one uint32_t per node) against Buddy (one byte
+ *    per node) and the sparse tree. Footprint is the heap the allocator
+ *    holds, by mallinfo2, after it has placed a quarter of the arena in
+ *    single units and moved some of them to random places. Walk speed is
+ *    size() and free() + alloc(1) on random live units of that arena.
+ *    Needs glibc 2.33 or later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <chrono>
+#include <vector>
+#include "../buddy.h"
+#include "reference_buddy.h"
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static volatile uint64_t sink;
+
+static size_t heap() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+template<typename B>
+static void run(const char* name, uint32_t level) {
+    uint32_t units = 1u << level;
+    std::vector<uint32_t> live;
+    live.reserve(units / 4);
+
+    size_t before = heap();
+    B* buddy = new B(level);
+
+    srand(1);
+    for (uint32_t i = 0; i < units / 4; ++i) {
+        uint32_t offset = buddy->alloc(1);
+        live.push_back(offset);
+    }
+
+    for (uint32_t i = 0; i < units / 16; ++i) {
+        size_t k = (size_t)rand() % live.size();
+        buddy->free(live[k]);
+        live[k] = buddy->alloc(1);
+    }
+
+    size_t footprint = heap() - before;
+
+    size_t ops = 500000;
+    std::vector<size_t> picks(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        picks[i] = (size_t)rand() % live.size();
+    }
+
+    double start = now();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        sum += buddy->size(live[picks[i]]);
+    }
+
+    double size_ns = (now() - start) * 1e9 / ops;
+
+    start = now();
+    for (size_t i = 0; i < ops; ++i) {
+        uint32_t& offset = live[picks[i]];
+        buddy->free(offset);
+        offset = buddy->alloc(1);
+    }
+
+    double churn_ns = (now() - start) * 1e9 / ops;
+
+    sink = sum;
+    printf("%6u %-8s %12.1f %12.1f %16.1f\n", level, name, footprint / 1048576.0, size_ns, churn_ns);
+    delete buddy;
+}
+
+int main() {
+    printf("%6s %-8s %12s %12s %16s\n", "level", "tree", "MiB", "size ns", "free+alloc ns");
+    for (uint32_t level = 20; level <= 26; level += 2) {
+        run<WalkBuddy>("walk", level);
+        run<Buddy>("dense", level);
+        run<BasicBuddy<uint32_t, SparseTree<uint32_t> > >("sparse", level);
+    }
+
+    return 0;
+}
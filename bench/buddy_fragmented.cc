@@ -0,0 +1,103 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. buddy_fragmented.cc -o buddy_fragmented
+ *
+ *    Buddy against the original tree walk (reference_buddy.h) on a
+ *    fragmented arena. The arena is filled with single units and every
+ *    other one freed, so half of it is free and no two free units are
+ *    buddies. Then:
+ *
+ *      fail   alloc(2) on that arena, which can never succeed
+ *      churn  free a random live unit, alloc(1)
+ *      mixed  free a random live block, alloc 1..64 units
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "../buddy.h"
+#include "reference_buddy.h"
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<typename B>
+static void fragment(B& buddy, uint32_t level, std::vector<uint32_t>& live) {
+    for (uint32_t i = 0; i < (1u << level); ++i) {
+        buddy.alloc(1);
+    }
+
+    for (uint32_t i = 0; i < (1u << level); ++i) {
+        if (i & 1) {
+            buddy.free(i);
+        } else {
+            live.push_back(i);
+        }
+    }
+}
+
+template<typename B>
+static double fail(uint32_t level, size_t& ops) {
+    B buddy(level);
+    std::vector<uint32_t> live;
+    fragment(buddy, level, live);
+
+    double start = now();
+    ops = 0;
+    while (now() - start < 0.5) {
+        for (int i = 0; i < 16; ++i, ++ops) {
+            if (buddy.alloc(2) != B::npos) {
+                abort();
+            }
+        }
+    }
+
+    return (now() - start) * 1e9 / ops;
+}
+
+template<typename B>
+static double churn(uint32_t level, uint32_t max_size, size_t ops) {
+    B buddy(level);
+    std::vector<uint32_t> live;
+    fragment(buddy, level, live);
+
+    srand(1);
+    double start = now();
+    for (size_t i = 0; i < ops; ++i) {
+        size_t k = (size_t)rand() % live.size();
+        buddy.free(live[k]);
+        uint32_t offset = buddy.alloc(1 + (uint32_t)rand() % max_size);
+        if (offset != B::npos) {
+            live[k] = offset;
+        } else {
+            live[k] = live.back();
+            live.pop_back();
+        }
+    }
+
+    return (now() - start) * 1e9 / ops;
+}
+
+int main() {
+    printf("%6s %8s %10s %14s %14s %8s\n", "level", "workload", "ops", "walk ns/op", "buddy ns/op", "speedup");
+    for (uint32_t level = 20; level <= 22; level += 2) {
+        size_t walk_ops = 0;
+        size_t buddy_ops = 0;
+        double walk = fail<WalkBuddy>(level, walk_ops);
+        double buddy = fail<Buddy>(level, buddy_ops);
+        printf("%6u %8s %10zu %14.1f %14.1f %7.0fx\n", level, "fail", buddy_ops, walk, buddy, walk / buddy);
+
+        size_t ops = 200000;
+        walk = churn<WalkBuddy>(level, 1, ops);
+        buddy = churn<Buddy>(level, 1, ops);
+        printf("%6u %8s %10zu %14.1f %14.1f %7.1fx\n", level, "churn", ops, walk, buddy, walk / buddy);
+
+        ops = 5000;
+        walk = churn<WalkBuddy>(level, 64, ops);
+        buddy = churn<Buddy>(level, 64, ops);
+        printf("%6u %8s %10zu %14.1f %14.1f %7.1fx\n", level, "mixed", ops, walk, buddy, walk / buddy);
+    }
+
+    return 0;
+}
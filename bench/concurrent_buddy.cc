@@ -0,0 +1,90 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. concurrent_buddy.cc -o concurrent_buddy -pthread
+ *
+ *    Contention from 1 to N threads: ConcurrentBuddy against one Buddy
+ *    behind a global mutex. Every thread keeps up to 64 blocks of 1 to
+ *    16 units live and frees one for every alloc past that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../concurrentbuddy.h"
+
+class LockedBuddy {
+public:
+    LockedBuddy(uint32_t level) : _buddy(level) {}
+
+    uint32_t alloc(uint32_t size) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _buddy.alloc(size);
+    }
+
+    void free(uint32_t offset) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _buddy.free(offset);
+    }
+
+private:
+    std::mutex _mutex;
+    Buddy _buddy;
+};
+
+template<typename B>
+static double run(B& buddy, unsigned threads, size_t ops) {
+    std::vector<std::thread> workers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back(
+            [&buddy, ops, t] {
+                uint32_t seed = t * 2654435761u + 1;
+                std::vector<uint32_t> live;
+                for (size_t i = 0; i < ops; ++i) {
+                    seed = seed * 1103515245 + 12345;
+                    if (live.size() >= 64) {
+                        size_t k = (seed >> 8) % live.size();
+                        buddy.free(live[k]);
+                        live[k] = live.back();
+                        live.pop_back();
+                    }
+
+                    uint32_t offset = buddy.alloc(1 + (seed >> 16) % 16);
+                    if (offset != Buddy::npos) {
+                        live.push_back(offset);
+                    }
+                }
+
+                for (size_t i = 0; i < live.size(); ++i) {
+                    buddy.free(live[i]);
+                }
+            }
+        );
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return threads * ops / seconds / 1e6;
+}
+
+int main(int argc, char** argv) {
+    unsigned max_threads = argc > 1 ? (unsigned)atoi(argv[1]) : std::thread::hardware_concurrency() * 2;
+    size_t ops = 1000000;
+
+    printf("cpus %u\n", std::thread::hardware_concurrency());
+    printf("%8s %14s %14s\n", "threads", "locked Mops/s", "sharded Mops/s");
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        LockedBuddy locked(24);
+        ConcurrentBuddy sharded(24);
+        double a = run(locked, threads, ops);
+        double b = run(sharded, threads, ops);
+        printf("%8u %14.2f %14.2f\n", threads, a, b);
+    }
+
+    return 0;
+}
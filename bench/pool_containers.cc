@@ -0,0 +1,129 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. pool_containers.cc -o pool_containers
+ *
+ *    Node-based containers with std::allocator against PoolAllocator<T>,
+ *    and new/delete against ObjectPool<T>. Each test fills a container,
+ *    erases and re-inserts half of it at random and clears it; the
+ *    times are ns per inserted element.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "../allocator.h"
+
+enum {
+    COUNT = 100000,
+    ROUNDS = 20
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static volatile size_t sink;
+
+template<typename List>
+static double list_test() {
+    double start = now();
+    for (int r = 0; r < ROUNDS; ++r) {
+        List l;
+        for (int i = 0; i < COUNT; ++i) {
+            l.push_back(i);
+        }
+
+        for (typename List::iterator it = l.begin(); it != l.end();) {
+            if (*it & 1) {
+                it = l.erase(it);
+                l.push_front(0);
+            } else {
+                ++it;
+            }
+        }
+
+        sink += l.size();
+    }
+
+    return (now() - start) * 1e9 / (ROUNDS * COUNT * 1.5);
+}
+
+template<typename Map>
+static double map_test(const std::vector<int>& keys) {
+    double start = now();
+    for (int r = 0; r < ROUNDS; ++r) {
+        Map m;
+        for (int i = 0; i < COUNT; ++i) {
+            m[keys[i]] = i;
+        }
+
+        for (int i = 0; i < COUNT; i += 2) {
+            m.erase(keys[i]);
+        }
+
+        for (int i = 0; i < COUNT; i += 2) {
+            m[keys[i]] = i;
+        }
+
+        sink += m.size();
+    }
+
+    return (now() - start) * 1e9 / (ROUNDS * COUNT * 1.5);
+}
+
+struct Node {
+    Node(int key, Node* next) : key(key), next(next) {}
+
+    int key;
+    Node* next;
+    char payload[40];
+};
+
+template<bool pooled>
+static double object_test() {
+    std::vector<Node*> nodes(COUNT);
+    double start = now();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < COUNT; ++i) {
+            nodes[i] = pooled ? ObjectPool<Node>::construct(i, (Node*)0) : new Node(i, 0);
+        }
+
+        for (int i = 0; i < COUNT; ++i) {
+            if (pooled) {
+                ObjectPool<Node>::destroy(nodes[i]);
+            } else {
+                delete nodes[i];
+            }
+        }
+    }
+
+    return (now() - start) * 1e9 / (ROUNDS * COUNT);
+}
+
+static void report(const char* name, double plain, double pool) {
+    printf("%-14s %10.1f %10.1f %7.2fx\n", name, plain, pool, plain / pool);
+}
+
+int main() {
+    std::vector<int> keys(COUNT);
+    for (int i = 0; i < COUNT; ++i) {
+        keys[i] = rand();
+    }
+
+    printf("%-14s %10s %10s %8s\n", "container", "std ns", "pool ns", "speedup");
+    report("list",
+        list_test<std::list<int> >(),
+        list_test<std::list<int, PoolAllocator<int> > >());
+    report("map",
+        map_test<std::map<int, int> >(keys),
+        map_test<std::map<int, int, std::less<int>, PoolAllocator<std::pair<const int, int> > > >(keys));
+    report("unordered_map",
+        map_test<std::unordered_map<int, int> >(keys),
+        map_test<std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, PoolAllocator<std::pair<const int, int> > > >(keys));
+    report("new/delete", object_test<false>(), object_test<true>());
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+#ifndef __REFERENCE_BUDDY_H__
+#define __REFERENCE_BUDDY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <vector>
+
+/*
+ *    The Buddy this tree started with, kept as the baseline for the
+ *    benches: one uint32_t state per node and a depth-first walk with
+ *    backtracking for alloc, free and size. The original alloc never
+ *    moved on from a right child that did not fit and free left FULL on
+ *    the ancestors of the freed block; here alloc climbs back up and free
+ *    clears them, so it runs to completion. The walks are unchanged.
+ */
+
+class WalkBuddy {
+public:
+    WalkBuddy(uint32_t level);
+    uint32_t alloc(uint32_t size);
+    void free(uint32_t offset);
+    uint32_t size(uint32_t offset);
+
+    size_t footprint() const;
+
+    static const uint32_t npos = UINT_MAX;
+
+private:
+    enum {
+        NODE_UNUSED,
+        NODE_USED,
+        NODE_SPLIT,
+        NODE_FULL
+    };
+
+    uint32_t _next_pow_of_2(uint32_t n);
+    uint32_t _index_offset(uint32_t index, uint32_t level);
+    void _mark_parent(uint32_t index);
+    void _combine(uint32_t index);
+
+    uint32_t _level;
+    std::vector<uint32_t> _tree;
+};
+
+inline WalkBuddy::WalkBuddy(uint32_t level) : _level(level) {
+    _tree.resize((size_t)1 << (level + 1), NODE_UNUSED);
+}
+
+inline size_t WalkBuddy::footprint() const {
+    return _tree.size() * sizeof(uint32_t);
+}
+
+inline uint32_t WalkBuddy::_next_pow_of_2(uint32_t n) {
+    if (!(n & (n - 1))) {
+        return n;
+    }
+
+    n |= n >> 1;
+    n |= n >> 2;
+    n |= n >> 4;
+    n |= n >> 8;
+    n |= n >> 16;
+
+    return n + 1;
+}
+
+inline uint32_t WalkBuddy::_index_offset(uint32_t index, uint32_t level) {
+    uint32_t left = 0;
+    uint32_t length = 1 << (_level - level);
+    while (index > 1) {
+        if (index & 1) {
+            left += length;
+        }
+
+        index /= 2;
+        length *= 2;
+    }
+
+    return left;
+}
+
+inline void WalkBuddy::_mark_parent(uint32_t index) {
+    while (index > 1) {
+        uint32_t buddy = index ^ 1;
+        if (_tree[buddy] == NODE_USED || _tree[buddy] == NODE_FULL) {
+            index /= 2;
+            _tree[index] = NODE_FULL;
+        } else {
+            break;
+        }
+    }
+}
+
+inline uint32_t WalkBuddy::alloc(uint32_t size) {
+    size = _next_pow_of_2(size ? size : 1);
+    uint32_t length = 1 << _level;
+
+    if (size > length) {
+        return npos;
+    }
+
+    uint32_t index = 1;
+    uint32_t level = 0;
+
+    while (index > 0) {
+        if (size == length) {
+            if (_tree[index] == NODE_UNUSED) {
+                _tree[index] = NODE_USED;
+                _mark_parent(index);
+                return _index_offset(index, level);
+            }
+        } else {
+            switch (_tree[index]) {
+            case NODE_USED:
+            case NODE_FULL:
+                break;
+            case NODE_UNUSED:
+                _tree[index] = NODE_SPLIT;
+                _tree[index * 2] = NODE_UNUSED;
+                _tree[index * 2 + 1] = NODE_UNUSED;
+                // fall through
+            default:
+                index = index * 2;
+                length /= 2;
+                ++level;
+                continue;
+            }
+        }
+
+        while (index & 1) {
+            index /= 2;
+            length *= 2;
+            --level;
+        }
+
+        if (index > 0) {
+            ++index;
+        }
+    }
+
+    return npos;
+}
+
+inline void WalkBuddy::_combine(uint32_t index) {
+    for (;;) {
+        _tree[index] = NODE_UNUSED;
+        if (index == 1 || _tree[index ^ 1] != NODE_UNUSED) {
+            break;
+        }
+
+        index /= 2;
+    }
+
+    for (index /= 2; index > 0; index /= 2) {
+        if (_tree[index] == NODE_FULL) {
+            _tree[index] = NODE_SPLIT;
+        }
+    }
+}
+
+inline void WalkBuddy::free(uint32_t offset) {
+    uint32_t left = 0;
+    uint32_t length = 1 << _level;
+    uint32_t index = 1;
+
+    for (;;) {
+        switch (_tree[index]) {
+        case NODE_USED:
+            _combine(index);
+            return;
+        case NODE_UNUSED:
+            return;
+        default:
+            length /= 2;
+            if (offset < left + length) {
+                index = index * 2;
+            } else {
+                left += length;
+                index = index * 2 + 1;
+            }
+            break;
+        }
+    }
+}
+
+inline uint32_t WalkBuddy::size(uint32_t offset) {
+    uint32_t left = 0;
+    uint32_t length = 1 << _level;
+    uint32_t index = 1;
+
+    for (;;) {
+        switch (_tree[index]) {
+        case NODE_USED:
+        case NODE_UNUSED:
+            return length;
+        default:
+            length /= 2;
+            if (offset < left + length) {
+                index = index * 2;
+            } else {
+                left += length;
+                index = index * 2 + 1;
+            }
+            break;
+        }
+    }
+}
+#endif
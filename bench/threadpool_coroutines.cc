@@ -0,0 +1,105 @@
+/*
+ *    g++ -std=c++20 -O2 -I.. threadpool_coroutines.cc -o threadpool_coroutines -pthread
+ *
+ *    Fan-out/fan-in on 4 workers: width parts each square one number and
+ *    the results are summed. "coroutine" is one CoTask that schedules the
+ *    parts on the pool and co_awaits when_all, so nothing blocks while
+ *    they run; "std::future" and "PooledFuture" queue the parts with
+ *    enqueue and submit and the caller waits on each result in turn.
+ *    Prints ns per part.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <future>
+#include <vector>
+#include "../threadpool.h"
+
+enum {
+    PARTS = 200000
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static CoTask<long> square(ThreadPool& pool, int x) {
+    co_await pool.schedule();
+    co_return (long)x * x;
+}
+
+static CoTask<long> fan(ThreadPool& pool, int width) {
+    std::vector<CoTask<long> > parts;
+    for (int i = 0; i < width; ++i) {
+        parts.push_back(square(pool, i));
+    }
+
+    std::vector<long> results = co_await when_all(std::move(parts));
+    long sum = 0;
+    for (long r : results) {
+        sum += r;
+    }
+
+    co_return sum;
+}
+
+static long by_coroutine(ThreadPool& pool, int width) {
+    return sync_wait(fan(pool, width));
+}
+
+static long by_future(ThreadPool& pool, int width) {
+    std::vector<std::future<long> > parts;
+    for (int i = 0; i < width; ++i) {
+        parts.push_back(pool.enqueue([i] { return (long)i * i; }));
+    }
+
+    long sum = 0;
+    for (std::future<long>& part : parts) {
+        sum += part.get();
+    }
+
+    return sum;
+}
+
+static long by_pooled(ThreadPool& pool, int width) {
+    std::vector<PooledFuture<long> > parts;
+    for (int i = 0; i < width; ++i) {
+        parts.push_back(pool.submit([i] { return (long)i * i; }));
+    }
+
+    long sum = 0;
+    for (PooledFuture<long>& part : parts) {
+        sum += part.get();
+    }
+
+    return sum;
+}
+
+template<class F>
+static double time_ns(ThreadPool& pool, int width, F fn) {
+    long want = 0;
+    for (int i = 0; i < width; ++i) {
+        want += (long)i * i;
+    }
+
+    double start = now();
+    for (int r = 0; r < PARTS / width; ++r) {
+        if (fn(pool, width) != want) {
+            printf("bad sum\n");
+        }
+    }
+
+    return (now() - start) * 1e9 / (PARTS / width * width);
+}
+
+int main() {
+    ThreadPool pool(4);
+
+    printf("%8s %12s %12s %14s\n", "width", "coroutine", "std::future", "PooledFuture");
+    for (int width = 10; width <= 100000; width *= 10) {
+        printf("%8d %12.0f %12.0f %14.0f\n", width,
+            time_ns(pool, width, by_coroutine), time_ns(pool, width, by_future), time_ns(pool, width, by_pooled));
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_latency.cc -o threadpool_latency -pthread
+ *
+ *    Task-start latency for bursty microsecond work: the main thread
+ *    queues one task, waits for it to start, then pauses 50 us so the
+ *    worker goes idle again. Compared are the original pool (LockedPool,
+ *    condition variable only), ThreadPool parking straight away, and
+ *    ThreadPool with set_idle_policy(2000, 100). A second table queues
+ *    bursts of 64 tasks one by one and through enqueue_batch and reports
+ *    the start of the last one. Prints p50 and p99 in microseconds.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "../threadpool.h"
+#include "reference_threadpool.h"
+
+enum {
+    SAMPLES = 2000,
+    BURST = 64
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static void pause_us(int us) {
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < until) {
+        std::this_thread::yield();
+    }
+}
+
+static void report(const char* name, std::vector<double>& v) {
+    std::sort(v.begin(), v.end());
+    printf("%-22s %10.1f %10.1f\n", name, v[v.size() / 2], v[v.size() * 99 / 100]);
+}
+
+template<class Pool>
+static void single(Pool& pool, const char* name) {
+    std::vector<double> v;
+    for (int r = 0; r < SAMPLES; ++r) {
+        std::atomic<bool> started(false);
+        double us = 0;
+        Clock::time_point start = Clock::now();
+        pool.enqueue([&] {
+            us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+            started = true;
+        });
+
+        while (!started.load()) {
+            std::this_thread::yield();
+        }
+
+        v.push_back(us);
+        pause_us(50);
+    }
+
+    report(name, v);
+}
+
+static void burst(ThreadPool& pool, bool batch, const char* name) {
+    std::vector<double> v;
+    for (int r = 0; r < SAMPLES / 10; ++r) {
+        std::atomic<int> started(0);
+        std::atomic<bool> last(false);
+        double us = 0;
+        Clock::time_point start = Clock::now();
+        std::vector<std::function<void()> > tasks(BURST,
+            [&] {
+                if (started.fetch_add(1) + 1 == BURST) {
+                    us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+                    last = true;
+                }
+            }
+        );
+
+        if (batch) {
+            pool.enqueue_batch(tasks);
+        } else {
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                pool.post(std::move(tasks[i]));
+            }
+        }
+
+        while (!last.load()) {
+            std::this_thread::yield();
+        }
+
+        v.push_back(us);
+        pause_us(50);
+    }
+
+    report(name, v);
+}
+
+int main() {
+    printf("%-22s %10s %10s\n", "one task", "p50 us", "p99 us");
+    {
+        LockedPool pool(1);
+        single(pool, "LockedPool");
+    }
+
+    {
+        ThreadPool pool(1);
+        single(pool, "ThreadPool park");
+        pool.set_idle_policy(2000, 100);
+        single(pool, "ThreadPool spin+yield");
+    }
+
+    printf("\n%-22s %10s %10s\n", "burst of 64", "p50 us", "p99 us");
+    {
+        ThreadPool pool(4);
+        burst(pool, false, "post x 64");
+        burst(pool, true, "enqueue_batch");
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_loops.cc -o threadpool_loops -pthread
+ *
+ *    parallel_reduce against a hand-written split: the range cut into
+ *    4 chunks per worker, one enqueue per chunk and a get() on every
+ *    future. "cheap" gives every index the same small amount of work,
+ *    "skewed" makes one index in 1000 cost 2000 times as much, which is
+ *    where fixed chunks fall behind. Workers from argv[1], default 4.
+ *    Prints ms per loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "../threadpool.h"
+
+enum {
+    COUNT = 1 << 20,
+    ROUNDS = 5
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double work(int i, bool skewed) {
+    int n = skewed && i % 1000 == 0 ? 20000 : 10;
+    double sum = 0;
+    for (int k = 0; k < n; ++k) {
+        sum += sqrt((double)(i + k));
+    }
+
+    return sum;
+}
+
+static double by_reduce(ThreadPool& pool, bool skewed) {
+    return pool.parallel_reduce(0, (int)COUNT, 0.0, [skewed](int i) { return work(i, skewed); }, std::plus<double>());
+}
+
+static double by_chunks(ThreadPool& pool, size_t chunks, bool skewed) {
+    std::vector<std::future<double> > parts;
+    int per = (int)(COUNT / chunks);
+    for (size_t c = 0; c < chunks; ++c) {
+        int begin = (int)c * per;
+        int end = c + 1 == chunks ? (int)COUNT : begin + per;
+        parts.push_back(pool.enqueue([begin, end, skewed] {
+            double sum = 0;
+            for (int i = begin; i < end; ++i) {
+                sum += work(i, skewed);
+            }
+
+            return sum;
+        }));
+    }
+
+    double sum = 0;
+    for (size_t c = 0; c < parts.size(); ++c) {
+        sum += parts[c].get();
+    }
+
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    size_t threads = argc > 1 ? (size_t)atoi(argv[1]) : 4;
+    ThreadPool pool(threads);
+
+    printf("%-8s %12s %12s\n", "work", "reduce ms", "enqueue ms");
+    for (int skewed = 0; skewed < 2; ++skewed) {
+        double sum = 0;
+        double start = now();
+        for (int r = 0; r < ROUNDS; ++r) {
+            sum += by_reduce(pool, skewed != 0);
+        }
+
+        double reduce = (now() - start) * 1e3 / ROUNDS;
+        start = now();
+        for (int r = 0; r < ROUNDS; ++r) {
+            sum -= by_chunks(pool, threads * 4, skewed != 0);
+        }
+
+        double chunks = (now() - start) * 1e3 / ROUNDS;
+        printf("%-8s %12.1f %12.1f%s\n", skewed ? "skewed" : "cheap", reduce, chunks, fabs(sum) > 1e-3 * COUNT ? " (sums differ)" : "");
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_pinning.cc -o threadpool_pinning -pthread
+ *
+ *    A memory-bound loop with and without pinning. The pool has one
+ *    group of one worker per cpu, pinned to that cpu or free to move.
+ *    Each group owns a buffer of argv[1] MiB (default 64) that its worker
+ *    touches first, so the pages sit on that worker's node, and every
+ *    round posts one summing pass over each buffer to its group. Prints
+ *    the aggregate read bandwidth in GB/s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../threadpool.h"
+
+enum {
+    ROUNDS = 20
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t sum(const uint64_t* p, size_t n) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        total += p[i];
+    }
+
+    return total;
+}
+
+static double run(bool pin, size_t cpus, size_t words) {
+    std::vector<ThreadPool::Group> groups(cpus);
+    for (size_t c = 0; c < cpus; ++c) {
+        groups[c].threads = 1;
+        if (pin) {
+            groups[c].cpus.push_back((int)c);
+            groups[c].pin = true;
+        }
+    }
+
+    ThreadPool pool(groups);
+    std::vector<uint64_t*> buffers(cpus);
+    std::vector<std::future<void> > touched;
+    for (size_t c = 0; c < cpus; ++c) {
+        buffers[c] = (uint64_t*)malloc(words * sizeof(uint64_t));
+        uint64_t* p = buffers[c];
+        touched.push_back(pool.enqueue_to(c, [p, words] {
+            for (size_t i = 0; i < words; ++i) {
+                p[i] = i;
+            }
+        }));
+    }
+
+    for (size_t c = 0; c < cpus; ++c) {
+        touched[c].get();
+    }
+
+    uint64_t total = 0;
+    double start = now();
+    for (int r = 0; r < ROUNDS; ++r) {
+        std::vector<std::future<uint64_t> > parts;
+        for (size_t c = 0; c < cpus; ++c) {
+            parts.push_back(pool.enqueue_to(c, sum, buffers[c], words));
+        }
+
+        for (size_t c = 0; c < cpus; ++c) {
+            total += parts[c].get();
+        }
+    }
+
+    double seconds = now() - start;
+    for (size_t c = 0; c < cpus; ++c) {
+        free(buffers[c]);
+    }
+
+    if (total != (uint64_t)ROUNDS * cpus * (words * (words - 1) / 2)) {
+        printf("bad sum\n");
+    }
+
+    return (double)ROUNDS * cpus * words * sizeof(uint64_t) / seconds / 1e9;
+}
+
+int main(int argc, char** argv) {
+    size_t mib = argc > 1 ? (size_t)atoi(argv[1]) : 64;
+    size_t cpus = std::thread::hardware_concurrency();
+    cpus = cpus ? cpus : 1;
+    size_t words = (mib << 20) / sizeof(uint64_t);
+
+    printf("%zu workers, %zu MiB each\n", cpus, mib);
+    printf("%-10s %8s\n", "workers", "GB/s");
+    printf("%-10s %8.2f\n", "unpinned", run(false, cpus, words));
+    printf("%-10s %8.2f\n", "pinned", run(true, cpus, words));
+
+    return 0;
+}
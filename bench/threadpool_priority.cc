@@ -0,0 +1,87 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_priority.cc -o threadpool_priority -pthread
+ *
+ *    Foreground requests behind background load on 4 workers. A feeder
+ *    thread keeps about 200 background jobs of ~50 us queued; the main
+ *    thread sends a short request every 200 us and records how long it
+ *    waited to start. The requests go in as NORMAL, like the background,
+ *    or as HIGH over LOW background. Prints p50, p99 and p99.9 request
+ *    start latency in microseconds, and background jobs done per second.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../threadpool.h"
+
+enum {
+    REQUESTS = 5000,
+    BACKLOG = 200
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static void spin_us(int us) {
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < until) {
+    }
+}
+
+static void run(const char* name, int request, int background) {
+    ThreadPool pool(4);
+    std::atomic<bool> stop(false);
+    std::atomic<long> queued(0);
+    std::atomic<long> done(0);
+
+    std::thread feeder([&] {
+        while (!stop.load()) {
+            if (queued.load() - done.load() < BACKLOG) {
+                ++queued;
+                pool.post_priority(background, [&done] {
+                    spin_us(50);
+                    ++done;
+                });
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    std::vector<double> waits(REQUESTS);
+    std::atomic<int> finished(0);
+    Clock::time_point begin = Clock::now();
+    for (int i = 0; i < REQUESTS; ++i) {
+        Clock::time_point sent = Clock::now();
+        double* wait = &waits[i];
+        pool.post_priority(request, [sent, wait, &finished] {
+            *wait = std::chrono::duration<double, std::micro>(Clock::now() - sent).count();
+            ++finished;
+        });
+
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    while (finished.load() < REQUESTS) {
+        std::this_thread::yield();
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    long jobs = done.load();
+    stop = true;
+    feeder.join();
+
+    std::sort(waits.begin(), waits.end());
+    printf("%-16s %10.1f %10.1f %10.1f %12.0f\n", name,
+        waits[REQUESTS / 2], waits[REQUESTS * 99 / 100], waits[REQUESTS * 999 / 1000], jobs / seconds);
+}
+
+int main() {
+    printf("%-16s %10s %10s %10s %12s\n", "requests", "p50 us", "p99 us", "p99.9 us", "jobs/s");
+    run("NORMAL", ThreadPool::PRIORITY_NORMAL, ThreadPool::PRIORITY_NORMAL);
+    run("HIGH over LOW", ThreadPool::PRIORITY_HIGH, ThreadPool::PRIORITY_LOW);
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_submit.cc -o threadpool_submit -pthread
+ *
+ *    Empty-task throughput on one worker: the original pool's enqueue
+ *    (packaged_task, bind, std::function and a future per task) against
+ *    ThreadPool's enqueue, submit (pooled future) and post (no future).
+ *    The main thread queues COUNT tasks and waits for the last one.
+ *    Prints ns per task.
+ */
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../threadpool.h"
+#include "reference_threadpool.h"
+
+enum {
+    COUNT = 1000000
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::atomic<long> done(0);
+
+static void empty() {
+    done.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void wait_for(long count) {
+    while (done.load() < count) {
+        std::this_thread::yield();
+    }
+}
+
+template<class Pool>
+static double run_enqueue() {
+    Pool pool(1);
+    done = 0;
+    double start = now();
+    for (int i = 0; i < COUNT; ++i) {
+        pool.enqueue(empty);
+    }
+
+    wait_for(COUNT);
+    return (now() - start) * 1e9 / COUNT;
+}
+
+static double run_submit() {
+    ThreadPool pool(1);
+    done = 0;
+    double start = now();
+    for (int i = 0; i < COUNT; ++i) {
+        pool.submit(empty);
+    }
+
+    wait_for(COUNT);
+    return (now() - start) * 1e9 / COUNT;
+}
+
+static double run_post() {
+    ThreadPool pool(1);
+    done = 0;
+    double start = now();
+    for (int i = 0; i < COUNT; ++i) {
+        pool.post(empty);
+    }
+
+    wait_for(COUNT);
+    return (now() - start) * 1e9 / COUNT;
+}
+
+int main() {
+    printf("%-22s %8s\n", "path", "ns/task");
+    printf("%-22s %8.1f\n", "LockedPool::enqueue", run_enqueue<LockedPool>());
+    printf("%-22s %8.1f\n", "ThreadPool::enqueue", run_enqueue<ThreadPool>());
+    printf("%-22s %8.1f\n", "ThreadPool::submit", run_submit());
+    printf("%-22s %8.1f\n", "ThreadPool::post", run_post());
+
+    return 0;
+}
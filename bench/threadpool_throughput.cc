@@ -0,0 +1,81 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_throughput.cc -o threadpool_throughput -pthread
+ *
+ *    Task throughput of the original single-queue pool (LockedPool, in
+ *    reference_threadpool.h) against ThreadPool, from 1 to N workers
+ *    (argv[1], default 64). "outside" enqueues tiny tasks from the main
+ *    thread, "nested" grows a binary tree of tasks that enqueue their
+ *    children from inside the pool, which is where the local deques and
+ *    stealing come in. Prints million tasks per second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "../threadpool.h"
+#include "reference_threadpool.h"
+
+enum {
+    OUTSIDE_CNT = 200000,
+    DEPTH = 17
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::atomic<long> done(0);
+
+static void wait_for(long count) {
+    while (done.load() < count) {
+        std::this_thread::yield();
+    }
+}
+
+template<class Pool>
+static void spawn(Pool* pool, int depth) {
+    done.fetch_add(1, std::memory_order_relaxed);
+    if (depth > 0) {
+        pool->enqueue(spawn<Pool>, pool, depth - 1);
+        pool->enqueue(spawn<Pool>, pool, depth - 1);
+    }
+}
+
+template<class Pool>
+static double outside(size_t threads) {
+    Pool pool(threads);
+    done = 0;
+    double start = now();
+    for (int i = 0; i < OUTSIDE_CNT; ++i) {
+        pool.enqueue([] { done.fetch_add(1, std::memory_order_relaxed); });
+    }
+
+    wait_for(OUTSIDE_CNT);
+    return OUTSIDE_CNT / (now() - start) / 1e6;
+}
+
+template<class Pool>
+static double nested(size_t threads) {
+    Pool pool(threads);
+    long count = (2L << DEPTH) - 1;
+    done = 0;
+    double start = now();
+    pool.enqueue(spawn<Pool>, &pool, (int)DEPTH);
+    wait_for(count);
+    return count / (now() - start) / 1e6;
+}
+
+int main(int argc, char** argv) {
+    size_t max = argc > 1 ? (size_t)atoi(argv[1]) : 64;
+
+    printf("%8s %14s %14s %14s %14s\n", "threads", "outside old", "outside new", "nested old", "nested new");
+    for (size_t threads = 1; threads <= max; threads *= 2) {
+        printf("%8zu %14.2f %14.2f %14.2f %14.2f\n", threads,
+            outside<LockedPool>(threads), outside<ThreadPool>(threads),
+            nested<LockedPool>(threads), nested<ThreadPool>(threads));
+    }
+
+    return 0;
+}
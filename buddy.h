@@ -1,191 +1,726 @@
-#ifndef __BUDDY_H__
-#define __BUDDY_H__
-
-#include <stdint.h>
-#include <vector>
-
-class Buddy {
-public:
-    Buddy(uint32_t level);
-    uint32_t alloc(uint32_t size);
-    void free(uint32_t offset);
-    uint32_t size(uint32_t offset);
-
-    static uint32_t npos;
-
-private:
-    bool _is_pow_of_2(uint32_t n);
-    uint32_t _next_pow_of_2(uint32_t n);
-    uint32_t _index_offset(uint32_t index, uint32_t level);
-    void _mark_parent(uint32_t index);
-    void _combine(uint32_t index);
-
-    enum {
-        NODE_UNUSED,
-        NODE_USED,
-        NODE_SPLIT,
-        NODE_FULL
-    };
-
-    uint32_t _level;
-    std::vector<uint32_t> _tree;
-};
-
-uint32_t Buddy::npos = UINT_MAX;
-
-Buddy::Buddy(uint32_t level) : _level(level) {
-    uint32_t size = 1 << (level + 1);
-    _tree.resize(size, NODE_UNUSED);
-}
-
-bool Buddy::_is_pow_of_2(uint32_t n) {
-    return !(n & (n - 1));
-}
-
-uint32_t Buddy::_next_pow_of_2(uint32_t n) {
-    if (_is_pow_of_2(n)) {
-        return n;
-    }
-
-    n |= n >> 1;
-    n |= n >> 2;
-    n |= n >> 4;
-    n |= n >> 8;
-    n |= n >> 16;
-
-    return n + 1;
-}
-
-uint32_t Buddy::_index_offset(uint32_t index, uint32_t level) {
-    uint32_t left = 0;
-    uint32_t length = 1 << (_level - level);
-    while (index > 1) {
-        if (index & 1) {
-            left += length;
-        }
-
-        index /= 2;
-        length *= 2;
-    }
-
-    return left;
-}
-
-void Buddy::_mark_parent(uint32_t index) {
-    for (;;) {
-        uint32_t buddy = index + 1 - (index & 1) * 2;
-        if (buddy > 0 && (_tree[buddy] == NODE_USED || _tree[buddy] == NODE_FULL)) {
-            index /= 2;
-            _tree[index] = NODE_FULL;
-        } else {
-            break;
-        }
-    }
-}
-
-uint32_t Buddy::alloc(uint32_t size) {
-    size = _next_pow_of_2(size);
-    uint32_t length = 1 << _level;
-
-    if (size > length) {
-        return npos;
-    }
-
-    uint32_t index = 1;
-    uint32_t level = 0;
-
-    while (index > 0) {
-        if (size == length) {
-            if (_tree[index] == NODE_UNUSED) {
-                _tree[index] = NODE_USED;
-                _mark_parent(index);
-                return _index_offset(index, level);
-            }
-        } else {
-            switch (_tree[index]) {
-            case NODE_USED:
-            case NODE_FULL:
-                break;
-            case NODE_UNUSED:
-                _tree[index] = NODE_SPLIT;
-                _tree[index * 2] = NODE_UNUSED;
-                _tree[index * 2 + 1] = NODE_UNUSED;
-            default:
-                index = index * 2;
-                length /= 2;
-                ++level;
-                continue;
-            }
-        }
-
-        if (!(index & 1)) {
-            ++index;
-            continue;
-        }
-    }
-
-    return npos;
-}
-
-void Buddy::_combine(uint32_t index) {
-    while (index > 0) {
-        _tree[index] = NODE_UNUSED;
-        uint32_t buddy = index + 1 - (index & 1) * 2;
-        if (_tree[buddy] == NODE_UNUSED) {
-            index /= 2;
-            continue;
-        }
-
-        break;
-    }
-}
-
-void Buddy::free(uint32_t offset) {
-    uint32_t left = 0;
-    uint32_t length = 1 << _level;
-    uint32_t index = 1;
-
-    for (;;) {
-        switch (_tree[index]) {
-        case NODE_USED:
-            _combine(index);
-            return;
-        case NODE_UNUSED:
-            return;
-        default:
-            length /= 2;
-            if (offset < left + length) {
-                index = index * 2;
-            } else {
-                left += length;
-                index = index * 2 + 1;
-            }
-            break;
-        }
-    }
-}
-
-uint32_t Buddy::size(uint32_t offset) {
-    uint32_t left = 0;
-    uint32_t length = 1 << _level;
-    uint32_t index = 1;
-
-    for (;;) {
-        switch (_tree[index]) {
-        case NODE_USED:
-            return length;
-        case NODE_UNUSED:
-            return length;
-        default:
-            length /= 2;
-            if (offset < left + length) {
-                index = index * 2;
-            } else {
-                left += length;
-                index = index * 2 + 1;
-            }
-            break;
-        }
-    }
-}
-#endif
+#ifndef __BUDDY_H__
+#define __BUDDY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+/*
+ *    Every node of the tree keeps the largest free order under it plus
+ *    one, 0 meaning nothing is free. A node of order k that is entirely
+ *    free holds k + 1, nodes below a free or allocated node are left at
+ *    their full value, so alloc follows one root-to-leaf path and free
+ *    walks up from the leaf until it meets the allocated node. The order
+ *    never exceeds 64, so one byte per node is enough.
+ *
+ *    The leaf row doubles as a per-unit order map: the first leaf of an
+ *    allocated block of order k > 0 holds k + LEAF_BLOCK, a leaf that is
+ *    itself allocated holds 0. free and size on a block offset read that
+ *    leaf instead of searching for the node, other offsets fall back to
+ *    the walk and resolve to the block containing them.
+ *
+ *    T is the offset type, the tree index needs level + 1 bits of it and
+ *    DenseTree one more for its node count; a level that doesn't fit
+ *    throws std::invalid_argument. DenseTree allocates every node up
+ *    front. SparseTree cuts the tree into subtrees of PAGE_LEVELS levels,
+ *    counted from the leaves so the short one is at the root, and only
+ *    keeps the pages of subtrees that have been written. A path from the
+ *    root touches one page per PAGE_LEVELS levels, untouched nodes read
+ *    as entirely free. A page is dropped when its subtree is entirely
+ *    free again: when its root is set back to its full value, or when a
+ *    leaf mark is cleared under a root that already reads full.
+ *    Everything below a free node holds its full value, so such a page
+ *    has nothing left to tell.
+ *
+ *    BasicBuddy<uint64_t, SparseTree<uint64_t> > disk(40);
+ *
+ *    alloc_n and free_n share one traversal for the whole batch and
+ *    update every parent once, after all of its children are done.
+ *    Node indices grow with depth, so free_n visits the parents in
+ *    decreasing index order from a sorted list and a queue that stays
+ *    sorted, and stops climbing where a parent doesn't change.
+ *
+ *    Usage counters and the number of free blocks of every order are
+ *    kept up to date on each split and merge, snapshot() copies them out
+ *    together with the largest free block.
+ */
+
+template<typename T>
+class DenseTree {
+public:
+    DenseTree(uint32_t level);
+
+    static uint32_t max_level();
+
+    uint8_t get(T index) const;
+    void set(T index, uint8_t value);
+
+private:
+    std::vector<uint8_t> _nodes;
+};
+
+template<typename T>
+class SparseTree {
+public:
+    enum {
+        PAGE_LEVELS = 12
+    };
+
+    SparseTree(uint32_t level);
+    ~SparseTree();
+
+    static uint32_t max_level();
+
+    uint8_t get(T index) const;
+    void set(T index, uint8_t value);
+
+    size_t pages() const;
+    size_t bytes() const;
+
+private:
+    SparseTree(const SparseTree&);
+    SparseTree& operator=(const SparseTree&);
+
+    static uint32_t _depth(T index);
+    uint8_t _full(T index) const;
+    T _page(T index, T& slot) const;
+    uint32_t _page_levels(T page) const;
+    uint8_t* _find(T page) const;
+
+    uint32_t _level;
+    uint32_t _shift;
+    size_t _bytes;
+    std::unordered_map<T, uint8_t*> _pages;
+    mutable T _last_page;
+    mutable uint8_t* _last;
+};
+
+template<typename T = uint32_t, typename Tree = DenseTree<T> >
+class BasicBuddy {
+public:
+    BasicBuddy(uint32_t level);
+    T alloc(T size);
+    void free(T offset);
+    T size(T offset);
+    T largest();
+
+    size_t alloc_n(T size, size_t count, T* out);
+    void free_n(const T* offsets, size_t count);
+
+    struct Snapshot {
+        T used;
+        T largest;
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t failed;
+        std::vector<T> blocks;
+    };
+
+    T used() const;
+    Snapshot snapshot();
+    const Tree& tree() const;
+
+    static T npos;
+
+private:
+    friend class BuddyHeap;
+
+    enum {
+        LEAF_FREE = 1,
+        LEAF_BLOCK = 2
+    };
+
+    static uint32_t _check(uint32_t level);
+
+    bool _is_pow_of_2(T n);
+    T _next_pow_of_2(T n);
+    uint32_t _order_of(T n);
+    T _index_offset(T index, uint32_t level);
+    void _mark_parent(T index);
+    T _combine(T index, uint32_t order);
+    T _free(T offset);
+    T _find(T offset);
+    T _locate(T offset);
+    void _mark_leaf(T offset, uint32_t order);
+    bool _update(T index);
+    void _alloc_n(T index, uint32_t level, uint32_t want, size_t count, T* out, size_t& n);
+    void _split(uint32_t order);
+    void _merge(uint32_t order);
+
+    uint32_t _level;
+    Tree _tree;
+
+    T _used;
+    uint64_t _allocs;
+    uint64_t _frees;
+    uint64_t _failed;
+    std::vector<T> _blocks;
+};
+
+typedef BasicBuddy<uint32_t> Buddy;
+
+template<typename T>
+DenseTree<T>::DenseTree(uint32_t level) {
+    size_t size = (size_t)1 << (level + 1);
+    _nodes.resize(size, 0);
+
+    uint8_t order = (uint8_t)(level + 1);
+    for (size_t index = 1; index < size; ++index) {
+        if (index > 1 && !(index & (index - 1))) {
+            --order;
+        }
+
+        _nodes[index] = order;
+    }
+}
+
+template<typename T>
+uint32_t DenseTree<T>::max_level() {
+    return (uint32_t)(sizeof(T) * CHAR_BIT - 2);
+}
+
+template<typename T>
+uint8_t DenseTree<T>::get(T index) const {
+    return _nodes[index];
+}
+
+template<typename T>
+void DenseTree<T>::set(T index, uint8_t value) {
+    _nodes[index] = value;
+}
+
+template<typename T>
+SparseTree<T>::SparseTree(uint32_t level)
+    : _level(level), _shift((PAGE_LEVELS - (level + 1) % PAGE_LEVELS) % PAGE_LEVELS), _bytes(0), _last_page(0), _last(0) {
+
+}
+
+template<typename T>
+uint32_t SparseTree<T>::max_level() {
+    return (uint32_t)(sizeof(T) * CHAR_BIT - 1);
+}
+
+template<typename T>
+SparseTree<T>::~SparseTree() {
+    for (typename std::unordered_map<T, uint8_t*>::iterator it = _pages.begin(); it != _pages.end(); ++it) {
+        delete [] it->second;
+    }
+}
+
+template<typename T>
+size_t SparseTree<T>::pages() const {
+    return _pages.size();
+}
+
+template<typename T>
+size_t SparseTree<T>::bytes() const {
+    return _bytes;
+}
+
+template<typename T>
+uint32_t SparseTree<T>::_depth(T index) {
+#if defined(__GNUC__)
+    return (uint32_t)(sizeof(unsigned long long) * CHAR_BIT - 1 - __builtin_clzll((unsigned long long)index));
+#else
+    uint32_t depth = 0;
+    while (index > 1) {
+        index >>= 1;
+        ++depth;
+    }
+
+    return depth;
+#endif
+}
+
+template<typename T>
+uint8_t SparseTree<T>::_full(T index) const {
+    return (uint8_t)(_level - _depth(index) + 1);
+}
+
+template<typename T>
+T SparseTree<T>::_page(T index, T& slot) const {
+    uint32_t depth = _depth(index);
+    uint32_t local = depth + _shift < PAGE_LEVELS ? depth : (depth + _shift) % PAGE_LEVELS;
+    slot = ((T)1 << local) | (index & (((T)1 << local) - 1));
+    return index >> local;
+}
+
+template<typename T>
+uint32_t SparseTree<T>::_page_levels(T page) const {
+    return PAGE_LEVELS - (_depth(page) + _shift) % PAGE_LEVELS;
+}
+
+template<typename T>
+uint8_t* SparseTree<T>::_find(T page) const {
+    if (_last && _last_page == page) {
+        return _last;
+    }
+
+    typename std::unordered_map<T, uint8_t*>::const_iterator it = _pages.find(page);
+    if (it == _pages.end()) {
+        return 0;
+    }
+
+    _last_page = page;
+    _last = it->second;
+    return _last;
+}
+
+template<typename T>
+uint8_t SparseTree<T>::get(T index) const {
+    T slot;
+    uint8_t* page = _find(_page(index, slot));
+    return page ? page[slot] : _full(index);
+}
+
+template<typename T>
+void SparseTree<T>::set(T index, uint8_t value) {
+    T slot;
+    T root = _page(index, slot);
+    uint8_t* page = _find(root);
+    if (value == _full(index)) {
+        if (!page) {
+            return;
+        }
+
+        if (slot == 1 || page[1] == _full(root)) {
+            _bytes -= (size_t)1 << _page_levels(root);
+            _pages.erase(root);
+            delete [] page;
+            _last = 0;
+            return;
+        }
+    }
+
+    if (!page) {
+        uint32_t levels = _page_levels(root);
+        page = new uint8_t[(size_t)1 << levels];
+        page[0] = 0;
+
+        uint8_t order = _full(root);
+        for (T i = 1; i < ((T)1 << levels); ++i) {
+            if (i > 1 && !(i & (i - 1))) {
+                --order;
+            }
+
+            page[i] = order;
+        }
+
+        _pages[root] = page;
+        _bytes += (size_t)1 << levels;
+        _last_page = root;
+        _last = page;
+    }
+
+    page[slot] = value;
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::npos = (T)~(T)0;
+
+template<typename T, typename Tree>
+BasicBuddy<T, Tree>::BasicBuddy(uint32_t level)
+    : _level(_check(level)), _tree(level), _used(0), _allocs(0), _frees(0), _failed(0), _blocks(level + 1, 0) {
+    _blocks[level] = 1;
+}
+
+template<typename T, typename Tree>
+uint32_t BasicBuddy<T, Tree>::_check(uint32_t level) {
+    if (level > Tree::max_level()) {
+        throw std::invalid_argument("Buddy level too large for its offset type");
+    }
+
+    return level;
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::_split(uint32_t order) {
+    --_blocks[order];
+    _blocks[order - 1] += 2;
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::_merge(uint32_t order) {
+    _blocks[order - 1] -= 2;
+    ++_blocks[order];
+}
+
+template<typename T, typename Tree>
+bool BasicBuddy<T, Tree>::_is_pow_of_2(T n) {
+    return !(n & (n - 1));
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::_next_pow_of_2(T n) {
+    if (_is_pow_of_2(n)) {
+        return n;
+    }
+
+    for (uint32_t shift = 1; shift < sizeof(T) * CHAR_BIT; shift *= 2) {
+        n |= n >> shift;
+    }
+
+    return n + 1;
+}
+
+template<typename T, typename Tree>
+uint32_t BasicBuddy<T, Tree>::_order_of(T n) {
+    uint32_t order = 0;
+    while (n > 1) {
+        n >>= 1;
+        ++order;
+    }
+
+    return order;
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::_index_offset(T index, uint32_t level) {
+    return (index - ((T)1 << level)) << (_level - level);
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::_mark_parent(T index) {
+    while (index > 1) {
+        index /= 2;
+        uint8_t left = _tree.get(index * 2);
+        uint8_t right = _tree.get(index * 2 + 1);
+        uint8_t longest = left > right ? left : right;
+        if (_tree.get(index) == longest) {
+            break;
+        }
+
+        _tree.set(index, longest);
+    }
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::alloc(T size) {
+    if (size == 0) {
+        size = 1;
+    }
+
+    size = _next_pow_of_2(size);
+    if (size == 0 || size > ((T)1 << _level)) {
+        ++_failed;
+        return npos;
+    }
+
+    uint32_t want = _order_of(size) + 1;
+    if (_tree.get(1) < want) {
+        ++_failed;
+        return npos;
+    }
+
+    T index = 1;
+    uint32_t level = 0;
+    while (_level - level + 1 != want) {
+        if (_tree.get(index) == _level - level + 1) {
+            _split(_level - level);
+        }
+
+        index = index * 2;
+        if (_tree.get(index) < want) {
+            ++index;
+        }
+
+        ++level;
+    }
+
+    T offset = _index_offset(index, level);
+    _tree.set(index, 0);
+    _mark_leaf(offset, _level - level);
+    _mark_parent(index);
+
+    --_blocks[want - 1];
+    _used += size;
+    ++_allocs;
+
+    return offset;
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::_combine(T index, uint32_t order) {
+    T merged = index;
+    while (index > 1) {
+        index /= 2;
+        uint8_t left = _tree.get(index * 2);
+        uint8_t right = _tree.get(index * 2 + 1);
+        if (left == order + 1 && right == order + 1) {
+            _tree.set(index, (uint8_t)(order + 2));
+            _merge(order + 1);
+            merged = index;
+        } else {
+            _tree.set(index, left > right ? left : right);
+        }
+
+        ++order;
+    }
+
+    return merged;
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::free(T offset) {
+    _free(offset);
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::_find(T offset) {
+    if (offset >= ((T)1 << _level)) {
+        return 0;
+    }
+
+    T index = offset + ((T)1 << _level);
+    while (_tree.get(index) != 0) {
+        if (index == 1) {
+            return 0;
+        }
+
+        index /= 2;
+    }
+
+    return index;
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::_mark_leaf(T offset, uint32_t order) {
+    if (order > 0) {
+        _tree.set(offset + ((T)1 << _level), (uint8_t)(order + LEAF_BLOCK));
+    }
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::_locate(T offset) {
+    if (offset >= ((T)1 << _level)) {
+        return 0;
+    }
+
+    T leaf = offset + ((T)1 << _level);
+    uint8_t mark = _tree.get(leaf);
+    if (mark == 0) {
+        return leaf;
+    }
+
+    if (mark >= LEAF_BLOCK) {
+        _tree.set(leaf, LEAF_FREE);
+        return leaf >> (mark - LEAF_BLOCK);
+    }
+
+    T index = _find(offset);
+    if (index != 0 && index < ((T)1 << _level)) {
+        uint32_t level = _order_of(index);
+        _tree.set(_index_offset(index, level) + ((T)1 << _level), LEAF_FREE);
+    }
+
+    return index;
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::_free(T offset) {
+    T index = _locate(offset);
+    if (index == 0) {
+        return 0;
+    }
+
+    uint32_t order = _level - _order_of(index);
+    _tree.set(index, (uint8_t)(order + 1));
+    ++_blocks[order];
+    _used -= (T)1 << order;
+    ++_frees;
+
+    return _combine(index, order);
+}
+
+template<typename T, typename Tree>
+bool BasicBuddy<T, Tree>::_update(T index) {
+    uint32_t order = _level - _order_of(index);
+    uint8_t left = _tree.get(index * 2);
+    uint8_t right = _tree.get(index * 2 + 1);
+    uint8_t value = left == order && right == order ? (uint8_t)(order + 1) : (left > right ? left : right);
+    if (_tree.get(index) == value) {
+        return false;
+    }
+
+    if (value == order + 1) {
+        _merge(order);
+    }
+
+    _tree.set(index, value);
+    return true;
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::_alloc_n(T index, uint32_t level, uint32_t want, size_t count, T* out, size_t& n) {
+    if (_level - level + 1 == want) {
+        T offset = _index_offset(index, level);
+        _tree.set(index, 0);
+        _mark_leaf(offset, want - 1);
+        --_blocks[want - 1];
+        out[n++] = offset;
+        return;
+    }
+
+    if (_tree.get(index) == _level - level + 1) {
+        _split(_level - level);
+    }
+
+    if (_tree.get(index * 2) >= want) {
+        _alloc_n(index * 2, level + 1, want, count, out, n);
+    }
+
+    if (n < count && _tree.get(index * 2 + 1) >= want) {
+        _alloc_n(index * 2 + 1, level + 1, want, count, out, n);
+    }
+
+    _update(index);
+}
+
+template<typename T, typename Tree>
+size_t BasicBuddy<T, Tree>::alloc_n(T size, size_t count, T* out) {
+    if (size == 0) {
+        size = 1;
+    }
+
+    size = _next_pow_of_2(size);
+    if (count == 0 || size == 0 || size > ((T)1 << _level)) {
+        _failed += count;
+        return 0;
+    }
+
+    uint32_t want = _order_of(size) + 1;
+    if (_tree.get(1) < want) {
+        _failed += count;
+        return 0;
+    }
+
+    size_t n = 0;
+    _alloc_n(1, 0, want, count, out, n);
+
+    _used += size * (T)n;
+    _allocs += n;
+    _failed += count - n;
+
+    return n;
+}
+
+template<typename T, typename Tree>
+void BasicBuddy<T, Tree>::free_n(const T* offsets, size_t count) {
+    std::vector<T> found;
+    found.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        T index = _locate(offsets[i]);
+        if (index != 0) {
+            found.push_back(index);
+        }
+    }
+
+    std::vector<T> parents;
+    parents.reserve(found.size());
+    for (size_t i = 0; i < found.size(); ++i) {
+        T index = found[i];
+        uint32_t order = _level - _order_of(index);
+        if (_tree.get(index) == order + 1) {
+            continue;
+        }
+
+        _tree.set(index, (uint8_t)(order + 1));
+        ++_blocks[order];
+        _used -= (T)1 << order;
+        ++_frees;
+        if (index > 1) {
+            parents.push_back(index / 2);
+        }
+    }
+
+    std::sort(parents.begin(), parents.end(), std::greater<T>());
+
+    std::vector<T> queue;
+    queue.reserve(parents.size());
+    size_t next = 0;
+    size_t head = 0;
+    T last = 0;
+    while (next < parents.size() || head < queue.size()) {
+        T index;
+        if (head == queue.size() || (next < parents.size() && parents[next] > queue[head])) {
+            index = parents[next++];
+        } else {
+            index = queue[head++];
+        }
+
+        if (index == last) {
+            continue;
+        }
+
+        last = index;
+        if (_update(index) && index > 1) {
+            queue.push_back(index / 2);
+        }
+    }
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::largest() {
+    uint8_t longest = _tree.get(1);
+    return longest ? (T)1 << (longest - 1) : 0;
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::used() const {
+    return _used;
+}
+
+template<typename T, typename Tree>
+const Tree& BasicBuddy<T, Tree>::tree() const {
+    return _tree;
+}
+
+template<typename T, typename Tree>
+typename BasicBuddy<T, Tree>::Snapshot BasicBuddy<T, Tree>::snapshot() {
+    Snapshot snap;
+    snap.used = _used;
+    snap.largest = largest();
+    snap.allocs = _allocs;
+    snap.frees = _frees;
+    snap.failed = _failed;
+    snap.blocks = _blocks;
+
+    return snap;
+}
+
+template<typename T, typename Tree>
+T BasicBuddy<T, Tree>::size(T offset) {
+    if (offset >= ((T)1 << _level)) {
+        return 0;
+    }
+
+    T index = offset + ((T)1 << _level);
+    uint8_t mark = _tree.get(index);
+    if (mark == 0) {
+        return 1;
+    }
+
+    if (mark >= LEAF_BLOCK) {
+        return (T)1 << (mark - LEAF_BLOCK);
+    }
+
+    T length = 0;
+    for (uint32_t order = 0; index > 0; index /= 2, ++order) {
+        uint8_t longest = _tree.get(index);
+        if (longest == 0) {
+            return (T)1 << order;
+        }
+
+        if (longest == order + 1) {
+            length = (T)1 << order;
+        }
+    }
+
+    return length;
+}
+#endif
@@ -0,0 +1,172 @@
+#ifndef __BUDDY_HEAP_H__
+#define __BUDDY_HEAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <new>
+#include <stdexcept>
+#include "buddy.h"
+
+/*
+ *    BuddyHeap heap(20, 4096);            // 4 GiB arena of 4 KiB units
+ *
+ *    void* p = heap.alloc(100000);       // 128 KiB block, 128 KiB aligned
+ *    assert(heap.size(p) == 131072);
+ *    heap.free(p);
+ *
+ *    The whole arena is reserved by one mmap up front. unit must be a
+ *    power of two, so that blocks are aligned to their own size up to
+ *    HUGE_PAGE_SIZE; any other unit throws std::invalid_argument. When a
+ *    free coalesces into a block of at least trim bytes, its pages are
+ *    handed back to the OS with MADV_DONTNEED, the address range stays
+ *    reserved. snapshot() counts in units, not bytes.
+ */
+
+class BuddyHeap {
+public:
+    enum {
+        PAGE_NORMAL,
+        PAGE_TRANSPARENT_HUGE,
+        PAGE_HUGETLB
+    };
+
+    enum {
+        HUGE_PAGE_SIZE = 1 << 21
+    };
+
+    BuddyHeap(uint32_t level, size_t unit = 4096, int page = PAGE_NORMAL, size_t trim = HUGE_PAGE_SIZE);
+    ~BuddyHeap();
+
+    void* alloc(size_t size);
+    void free(void* p);
+    size_t size(void* p);
+
+    bool contains(const void* p) const;
+    Buddy::Snapshot snapshot();
+
+private:
+    BuddyHeap(const BuddyHeap&);
+    BuddyHeap& operator=(const BuddyHeap&);
+
+    char* _map(size_t length, size_t align, int page);
+    uint32_t _offset(const void* p) const;
+
+    Buddy _buddy;
+    char* _base;
+    size_t _unit;
+    size_t _length;
+    size_t _trim;
+};
+
+inline BuddyHeap::BuddyHeap(uint32_t level, size_t unit, int page, size_t trim)
+    : _buddy(level), _base(0), _unit(unit), _length(unit << level), _trim(trim) {
+    if (unit == 0 || (unit & (unit - 1))) {
+        throw std::invalid_argument("BuddyHeap unit must be a power of two");
+    }
+
+    size_t align = _length < (size_t)HUGE_PAGE_SIZE ? _length : (size_t)HUGE_PAGE_SIZE;
+    _base = _map(_length, align, page);
+    if (!_base) {
+        throw std::bad_alloc();
+    }
+}
+
+inline BuddyHeap::~BuddyHeap() {
+    munmap(_base, _length);
+}
+
+inline char* BuddyHeap::_map(size_t length, size_t align, int page) {
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+#ifdef MAP_HUGETLB
+    if (page == PAGE_HUGETLB && !(length & (HUGE_PAGE_SIZE - 1))) {
+        void* p = mmap(0, length, prot, flags | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            return (char*)p;
+        }
+
+        page = PAGE_TRANSPARENT_HUGE;
+    }
+#endif
+
+    size_t reserve = length + align;
+    void* p = mmap(0, reserve, prot, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+
+    char* begin = (char*)p;
+    char* aligned = (char*)(((uintptr_t)begin + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned > begin) {
+        munmap(begin, aligned - begin);
+    }
+
+    char* end = begin + reserve;
+    if (end > aligned + length) {
+        munmap(aligned + length, end - (aligned + length));
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (page == PAGE_TRANSPARENT_HUGE) {
+        madvise(aligned, length, MADV_HUGEPAGE);
+    }
+#endif
+
+    return aligned;
+}
+
+inline bool BuddyHeap::contains(const void* p) const {
+    return (const char*)p >= _base && (const char*)p < _base + _length;
+}
+
+inline Buddy::Snapshot BuddyHeap::snapshot() {
+    return _buddy.snapshot();
+}
+
+inline uint32_t BuddyHeap::_offset(const void* p) const {
+    return (uint32_t)(((const char*)p - _base) / _unit);
+}
+
+inline void* BuddyHeap::alloc(size_t size) {
+    if (size > _length) {
+        return 0;
+    }
+
+    size_t units = (size + _unit - 1) / _unit;
+
+    uint32_t offset = _buddy.alloc((uint32_t)units);
+    if (offset == Buddy::npos) {
+        return 0;
+    }
+
+    return _base + (size_t)offset * _unit;
+}
+
+inline void BuddyHeap::free(void* p) {
+    if (!p || !contains(p)) {
+        return;
+    }
+
+    uint32_t index = _buddy._free(_offset(p));
+    if (index == 0) {
+        return;
+    }
+
+    uint32_t level = _buddy._order_of(index);
+    size_t length = _length >> level;
+    if (length >= _trim) {
+        char* begin = _base + (size_t)_buddy._index_offset(index, level) * _unit;
+        madvise(begin, length, MADV_DONTNEED);
+    }
+}
+
+inline size_t BuddyHeap::size(void* p) {
+    if (!p || !contains(p)) {
+        return 0;
+    }
+
+    return (size_t)_buddy.size(_offset(p)) * _unit;
+}
+#endif
@@ -0,0 +1,174 @@
+#ifndef __CONCURRENT_BUDDY_H__
+#define __CONCURRENT_BUDDY_H__
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "buddy.h"
+
+/*
+ *    The arena is cut into a power of two number of shards, each one a
+ *    Buddy of level - log2(shards) behind its own mutex. A thread
+ *    allocates from the shard of the cpu it runs on and steals from the
+ *    following shards when that one can't fit the request. Offsets are
+ *    global, so free and size find the owning shard from the high bits.
+ *    A single block can't be larger than one shard. In snapshot() a
+ *    failed alloc is one that no shard could serve. Every shard ends in
+ *    a cache line of padding, so shards allocated next to each other
+ *    never share a line.
+ */
+
+class ConcurrentBuddy {
+public:
+    ConcurrentBuddy(uint32_t level, uint32_t shards = 0);
+
+    uint32_t alloc(uint32_t size);
+    void free(uint32_t offset);
+    uint32_t size(uint32_t offset);
+
+    uint32_t shards() const;
+    Buddy::Snapshot snapshot();
+
+private:
+    ConcurrentBuddy(const ConcurrentBuddy&);
+    ConcurrentBuddy& operator=(const ConcurrentBuddy&);
+
+    struct Shard {
+        Shard(uint32_t level) : buddy(level), largest(1 << level) {}
+
+        std::mutex mutex;
+        Buddy buddy;
+        std::atomic<uint32_t> largest;
+        char pad[64];
+    };
+
+    uint32_t _home();
+    uint32_t _alloc_from(uint32_t shard, uint32_t size);
+
+    uint32_t _level;
+    uint32_t _shard_level;
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::atomic<uint64_t> _failed;
+};
+
+inline ConcurrentBuddy::ConcurrentBuddy(uint32_t level, uint32_t shards) : _level(level), _failed(0) {
+    if (shards == 0) {
+        shards = std::thread::hardware_concurrency();
+    }
+
+    uint32_t bits = 0;
+    while (bits < level && (2u << bits) <= shards) {
+        ++bits;
+    }
+
+    _shard_level = level - bits;
+    for (uint32_t i = 0; i < (1u << bits); ++i) {
+        _shards.emplace_back(new Shard(_shard_level));
+    }
+}
+
+inline uint32_t ConcurrentBuddy::shards() const {
+    return (uint32_t)_shards.size();
+}
+
+inline uint32_t ConcurrentBuddy::_home() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        return (uint32_t)cpu & (shards() - 1);
+    }
+#endif
+    return (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()) & (shards() - 1);
+}
+
+inline uint32_t ConcurrentBuddy::_alloc_from(uint32_t shard, uint32_t size) {
+    Shard& s = *_shards[shard];
+    if (s.largest.load(std::memory_order_relaxed) < size) {
+        return Buddy::npos;
+    }
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    uint32_t offset = s.buddy.alloc(size);
+    s.largest.store(s.buddy.largest(), std::memory_order_relaxed);
+
+    if (offset == Buddy::npos) {
+        return Buddy::npos;
+    }
+
+    return (shard << _shard_level) + offset;
+}
+
+inline uint32_t ConcurrentBuddy::alloc(uint32_t size) {
+    if (size > (1u << _shard_level)) {
+        _failed.fetch_add(1, std::memory_order_relaxed);
+        return Buddy::npos;
+    }
+
+    uint32_t home = _home();
+    uint32_t count = shards();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t offset = _alloc_from((home + i) & (count - 1), size);
+        if (offset != Buddy::npos) {
+            return offset;
+        }
+    }
+
+    _failed.fetch_add(1, std::memory_order_relaxed);
+    return Buddy::npos;
+}
+
+inline void ConcurrentBuddy::free(uint32_t offset) {
+    uint32_t shard = offset >> _shard_level;
+    if (shard >= shards()) {
+        return;
+    }
+
+    Shard& s = *_shards[shard];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.buddy.free(offset & ((1u << _shard_level) - 1));
+    s.largest.store(s.buddy.largest(), std::memory_order_relaxed);
+}
+
+inline Buddy::Snapshot ConcurrentBuddy::snapshot() {
+    Buddy::Snapshot snap;
+    snap.used = 0;
+    snap.largest = 0;
+    snap.allocs = 0;
+    snap.frees = 0;
+    snap.failed = _failed.load(std::memory_order_relaxed);
+    snap.blocks.resize(_shard_level + 1, 0);
+
+    for (uint32_t i = 0; i < shards(); ++i) {
+        Shard& s = *_shards[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        Buddy::Snapshot part = s.buddy.snapshot();
+        snap.used += part.used;
+        snap.largest = part.largest > snap.largest ? part.largest : snap.largest;
+        snap.allocs += part.allocs;
+        snap.frees += part.frees;
+        for (size_t order = 0; order < part.blocks.size(); ++order) {
+            snap.blocks[order] += part.blocks[order];
+        }
+    }
+
+    return snap;
+}
+
+inline uint32_t ConcurrentBuddy::size(uint32_t offset) {
+    uint32_t shard = offset >> _shard_level;
+    if (shard >= shards()) {
+        return 0;
+    }
+
+    Shard& s = *_shards[shard];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.buddy.size(offset & ((1u << _shard_level) - 1));
+}
+#endif
@@ -0,0 +1,318 @@
+/*
+ *    g++ -std=c++14 -O2 -I.. allocator_test.cc -o allocator_test -pthread && ./allocator_test
+ *
+ *    Allocator, ObjectPool and Arena. Objects move between threads
+ *    before they are freed, every object is filled and checked so
+ *    overlapping blocks show up, and the snapshot counters must come
+ *    back to zero live objects and, after trim(), zero chunk bytes.
+ *    Each test uses its own instantiation so their statics don't mix.
+ *    Meant to be run under -fsanitize=address and -fsanitize=thread as
+ *    well. With -std=c++11 the GeometricClasses checks are left out.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../allocator.h"
+
+template<typename A>
+static void check_empty() {
+    typename A::Snapshot snap = A::snapshot();
+    for (size_t i = 0; i < sizeof(snap.classes) / sizeof(snap.classes[0]); ++i) {
+        assert(snap.classes[i].live == 0);
+        assert(snap.classes[i].allocs == snap.classes[i].frees);
+    }
+
+    assert(snap.large_allocs == snap.large_frees);
+}
+
+template<typename A>
+static size_t chunk_bytes() {
+    typename A::Snapshot snap = A::snapshot();
+    size_t bytes = 0;
+    for (size_t i = 0; i < sizeof(snap.classes) / sizeof(snap.classes[0]); ++i) {
+        bytes += snap.classes[i].chunk_bytes;
+    }
+
+    return bytes;
+}
+
+struct Block {
+    unsigned char* p;
+    size_t size;
+    unsigned char fill;
+};
+
+static void cross_thread() {
+    typedef Allocator<16> A;
+    enum { THREADS = 4, COUNT = 20000 };
+
+    std::mutex mutex;
+    std::vector<Block> handed;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.push_back(std::thread([&, t] {
+            unsigned seed = t + 1;
+            std::vector<Block> mine;
+            for (int i = 0; i < COUNT; ++i) {
+                Block b;
+                b.size = 1 + rand_r(&seed) % 400;
+                b.fill = (unsigned char)(t * 16 + i);
+                b.p = (unsigned char*)A::alloc(b.size);
+                memset(b.p, b.fill, b.size);
+                mine.push_back(b);
+            }
+
+            std::vector<Block> theirs;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                handed.swap(mine);
+                theirs.swap(mine);
+            }
+
+            for (size_t i = 0; i < theirs.size(); ++i) {
+                for (size_t k = 0; k < theirs[i].size; ++k) {
+                    assert(theirs[i].p[k] == theirs[i].fill);
+                }
+
+                A::free(theirs[i].p);
+            }
+        }));
+    }
+
+    for (size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+
+    for (size_t i = 0; i < handed.size(); ++i) {
+        A::free(handed[i].p);
+    }
+
+    check_empty<A>();
+    A::trim();
+    assert(chunk_bytes<A>() == 0);
+}
+
+template<int base>
+static void alignment() {
+    typedef Allocator<base> A;
+    std::vector<void*> blocks;
+    for (size_t size = 0; size <= 20 * base; ++size) {
+        void* p = A::alloc(size);
+        assert(p && (uintptr_t)p % base == 0);
+        blocks.push_back(p);
+    }
+
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        A::free(blocks[i]);
+    }
+
+    A::free(0);
+    check_empty<A>();
+    A::trim();
+}
+
+static void retain_and_trim() {
+    typedef Allocator<32> A;
+    enum { COUNT = 100000 };
+
+    std::vector<void*> blocks(COUNT);
+    for (size_t i = 0; i < COUNT; ++i) {
+        blocks[i] = A::alloc(32);
+    }
+
+    size_t peak = chunk_bytes<A>();
+    assert(peak >= COUNT * 32);
+
+    A::set_retain(1 << 20);
+    for (size_t i = 0; i < COUNT; ++i) {
+        A::free(blocks[i]);
+    }
+
+    size_t retained = chunk_bytes<A>();
+    assert(retained >= 1 << 19 && retained < peak / 2);
+    A::trim();
+    assert(chunk_bytes<A>() == 0);
+
+    A::set_retain(0);
+    for (size_t i = 0; i < COUNT; ++i) {
+        blocks[i] = A::alloc(32);
+    }
+
+    for (size_t i = 0; i < COUNT; ++i) {
+        A::free(blocks[i]);
+    }
+
+    assert(chunk_bytes<A>() < retained / 4);
+    A::trim();
+    assert(chunk_bytes<A>() == 0);
+    check_empty<A>();
+}
+
+static void large_path() {
+    typedef Allocator<8> A;
+    void* small = A::alloc(128);
+    void* a = A::alloc(129);
+    void* b = A::alloc(10000);
+    memset(a, 1, 129);
+    memset(b, 2, 10000);
+
+    typename A::Snapshot snap = A::snapshot();
+    assert(snap.large_allocs == 2 && snap.large_frees == 0);
+    assert(snap.large_bytes == 129 + 10000);
+    assert(snap.classes[15].live == 1);
+
+    A::free(a);
+    A::free(b);
+    A::free(small);
+    snap = A::snapshot();
+    assert(snap.large_allocs == 2 && snap.large_frees == 2);
+    check_empty<A>();
+    A::trim();
+}
+
+static size_t sampled;
+
+static void sample(void*, size_t, void*) {
+    ++sampled;
+}
+
+static void sampler() {
+    typedef Allocator<16, LinearClasses<16, 4> > A;
+    A::set_sampler(sample, 1);
+    A::free(A::alloc(10));
+    A::free(A::alloc(1000));
+    A::set_sampler(0, 0);
+    A::free(A::alloc(10));
+    assert(sampled == 2);
+    A::trim();
+}
+
+static void huge_pages() {
+    typedef Allocator<16, LinearClasses<16, 8> > A;
+    A::set_huge_pages(true);
+
+    for (int round = 0; round < 2; ++round) {
+        std::vector<unsigned char*> blocks;
+        for (int i = 0; i < 50000; ++i) {
+            unsigned char* p = (unsigned char*)A::alloc(64);
+            assert((uintptr_t)p % 16 == 0);
+            memset(p, (unsigned char)i, 64);
+            blocks.push_back(p);
+        }
+
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            assert(blocks[i][63] == (unsigned char)i);
+            A::free(blocks[i]);
+        }
+
+        check_empty<A>();
+        A::trim();
+        assert(chunk_bytes<A>() == 0);
+    }
+}
+
+#if __cplusplus >= 201402L
+template<typename Classes, size_t base, size_t max>
+static void geometric() {
+    assert(Classes::size(Classes::SIZE_TYPE - 1) == max);
+    for (size_t size = 1; size <= max; ++size) {
+        size_t idx = Classes::locate(size);
+        assert(idx < (size_t)Classes::SIZE_TYPE);
+        assert(Classes::size(idx) >= size && Classes::size(idx) % base == 0);
+        assert(idx == 0 || Classes::size(idx - 1) < size);
+    }
+
+    typedef Allocator<base, Classes> A;
+    std::vector<void*> blocks;
+    for (size_t size = 1; size <= max; size += 97) {
+        void* p = A::alloc(size);
+        memset(p, 3, size);
+        blocks.push_back(p);
+    }
+
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        A::free(blocks[i]);
+    }
+
+    check_empty<A>();
+    A::trim();
+}
+#endif
+
+struct Node {
+    Node(int key, Node* next) : key(key), next(next) {}
+
+    int key;
+    Node* next;
+};
+
+static void object_pool() {
+    Node* head = 0;
+    for (int i = 0; i < 10000; ++i) {
+        head = ObjectPool<Node>::construct(i, head);
+    }
+
+    for (int i = 9999; head; --i) {
+        assert(head->key == i);
+        Node* next = head->next;
+        ObjectPool<Node>::destroy(head);
+        head = next;
+    }
+
+    ObjectPool<Node>::destroy(0);
+}
+
+static void arena() {
+    Arena<16> arena;
+    char* first = (char*)arena.alloc(100);
+    assert(first && (uintptr_t)first % 16 == 0);
+    assert(arena.alloc(0));
+
+    Arena<16>::Marker marker = arena.mark();
+    char* second = (char*)arena.alloc(50);
+    arena.rewind(marker);
+    assert(arena.alloc(50) == second);
+    arena.rewind(marker);
+
+    {
+        Arena<16>::Scope scope(arena);
+        char* big = (char*)arena.alloc(4 << 20);
+        memset(big, 1, 4 << 20);
+        for (int i = 0; i < 100000; ++i) {
+            char* p = (char*)arena.alloc(24);
+            assert((uintptr_t)p % 16 == 0);
+            memset(p, 2, 24);
+        }
+    }
+
+    assert(arena.alloc(50) == second);
+
+    arena.reset();
+    assert(arena.alloc(100) == first);
+}
+
+int main() {
+    cross_thread();
+    alignment<16>();
+    alignment<64>();
+    retain_and_trim();
+    large_path();
+    sampler();
+    huge_pages();
+#if __cplusplus >= 201402L
+    geometric<GeometricClasses<16>, 16, 32768>();
+    geometric<GeometricClasses<16, 2>, 16, 32768>();
+    geometric<GeometricClasses<8, 8, 4096>, 8, 4096>();
+#endif
+    object_pool();
+    arena();
+
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. buddy_test.cc -o buddy_test && ./buddy_test
+ *
+ *    Buddy against a brute-force model: a bitmap of used units where
+ *    alloc takes the leftmost aligned run that is entirely free, which is
+ *    the placement Buddy promises. Random alloc/free/alloc_n/free_n
+ *    sequences on every offset type and tree must give the same offsets,
+ *    sizes and snapshot counters as the model.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "../buddy.h"
+#include "../buddyheap.h"
+
+class Model {
+public:
+    Model(uint32_t level) : _units(1u << level), _used(_units, 0) {}
+
+    uint32_t alloc(uint32_t size) {
+        uint32_t length = 1;
+        while (length < size) {
+            length <<= 1;
+        }
+
+        for (uint32_t offset = 0; length <= _units && offset < _units; offset += length) {
+            if (_free(offset, length)) {
+                std::fill(_used.begin() + offset, _used.begin() + offset + length, 1);
+                _blocks[offset] = length;
+                return offset;
+            }
+        }
+
+        return UINT_MAX;
+    }
+
+    void free(uint32_t offset) {
+        uint32_t length = _blocks[offset];
+        std::fill(_used.begin() + offset, _used.begin() + offset + length, 0);
+        _blocks.erase(offset);
+    }
+
+    uint32_t size(uint32_t offset) {
+        return _blocks[offset];
+    }
+
+    uint64_t used() const {
+        uint64_t used = 0;
+        for (size_t i = 0; i < _used.size(); ++i) {
+            used += _used[i];
+        }
+
+        return used;
+    }
+
+    uint64_t blocks(uint32_t order) const {
+        uint32_t length = 1u << order;
+        uint64_t count = 0;
+        for (uint32_t offset = 0; offset < _units; offset += length) {
+            if (!_free(offset, length)) {
+                continue;
+            }
+
+            if (length < _units && _free(offset & ~(2 * length - 1), 2 * length)) {
+                continue;
+            }
+
+            ++count;
+        }
+
+        return count;
+    }
+
+private:
+    bool _free(uint32_t offset, uint32_t length) const {
+        for (uint32_t i = offset; i < offset + length; ++i) {
+            if (_used[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    uint32_t _units;
+    std::vector<char> _used;
+    std::map<uint32_t, uint32_t> _blocks;
+};
+
+template<typename B>
+static void check_snapshot(B& buddy, const Model& model, uint32_t level) {
+    typename B::Snapshot snap = buddy.snapshot();
+    assert((uint64_t)snap.used == model.used());
+    for (uint32_t order = 0; order <= level; ++order) {
+        assert((uint64_t)snap.blocks[order] == model.blocks(order));
+    }
+}
+
+template<typename B>
+static void random_ops(int seeds, uint32_t max_level) {
+    typedef typename std::remove_reference<decltype(B::npos)>::type T;
+
+    for (int seed = 0; seed < seeds; ++seed) {
+        srand(seed);
+        uint32_t level = 3 + seed % (max_level - 2);
+        Model model(level);
+        B buddy(level);
+        std::vector<uint32_t> live;
+
+        for (int i = 0; i < 3000; ++i) {
+            int op = rand() % 8;
+            uint32_t size = 1 + rand() % (1u << (rand() % (level + 1)));
+            if (op < 3 && !live.empty()) {
+                size_t k = rand() % live.size();
+                assert(buddy.size(live[k]) == model.size(live[k]));
+                model.free(live[k]);
+                buddy.free(live[k]);
+                live[k] = live.back();
+                live.pop_back();
+            } else if (op == 3 && !live.empty()) {
+                for (size_t j = live.size(); j > 1; --j) {
+                    std::swap(live[j - 1], live[rand() % j]);
+                }
+
+                size_t k = rand() % (live.size() + 1);
+                std::vector<T> batch(live.begin(), live.begin() + k);
+                for (size_t j = 0; j < k; ++j) {
+                    model.free(live[j]);
+                }
+
+                if (k) {
+                    batch.push_back(batch[0]);
+                }
+
+                buddy.free_n(batch.data(), batch.size());
+                live.erase(live.begin(), live.begin() + k);
+            } else if (op == 4) {
+                size_t count = rand() % 40;
+                std::vector<T> out(count);
+                size_t got = buddy.alloc_n(size, count, out.data());
+                for (size_t j = 0; j < count; ++j) {
+                    uint32_t offset = model.alloc(size);
+                    if (j >= got) {
+                        assert(offset == UINT_MAX);
+                        break;
+                    }
+
+                    assert(offset == out[j]);
+                    live.push_back(offset);
+                }
+            } else if (op == 5 && i % 16 == 0) {
+                check_snapshot(buddy, model, level);
+            } else {
+                T offset = buddy.alloc(size);
+                assert((offset == B::npos ? UINT_MAX : (uint32_t)offset) == model.alloc(size));
+                if (offset != B::npos) {
+                    live.push_back((uint32_t)offset);
+                }
+            }
+        }
+
+        check_snapshot(buddy, model, level);
+    }
+}
+
+static void interior_offsets() {
+    Buddy buddy(4);
+    assert(buddy.alloc(4) == 0);
+    assert(buddy.alloc(1) == 4);
+    assert(buddy.size(2) == 4 && buddy.size(0) == 4 && buddy.size(4) == 1 && buddy.size(5) == 1 && buddy.size(8) == 8);
+
+    buddy.free(2);
+    assert(buddy.alloc(4) == 0);
+    buddy.free(0);
+    buddy.free(4);
+    assert(buddy.largest() == 16);
+}
+
+static void huge_arena() {
+    BasicBuddy<uint64_t, SparseTree<uint64_t> > disk(50);
+    uint64_t a = disk.alloc((uint64_t)1 << 45);
+    uint64_t b = disk.alloc(4096);
+    uint64_t c = disk.alloc(3);
+    assert(a == 0 && b == (uint64_t)1 << 45 && disk.size(c) == 4);
+
+    disk.free(a);
+    disk.free(b);
+    disk.free(c);
+    assert(disk.largest() == (uint64_t)1 << 50);
+    assert(disk.tree().pages() == 0);
+}
+
+static void sparse_pages() {
+    BasicBuddy<uint64_t, SparseTree<uint64_t> > disk(40);
+    uint64_t one = disk.alloc(1);
+    assert(disk.tree().pages() == 4 && disk.tree().bytes() < 16384);
+
+    srand(7);
+    std::vector<uint64_t> live;
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 1000; ++i) {
+            live.push_back(disk.alloc(1 + ((uint64_t)rand() << 8) % ((uint64_t)1 << 30)));
+        }
+
+        while (!live.empty()) {
+            disk.free(live.back());
+            live.pop_back();
+        }
+
+        assert(disk.tree().pages() == 4);
+    }
+
+    disk.free(one);
+    assert(disk.tree().pages() == 0 && disk.tree().bytes() == 0);
+}
+
+template<typename B>
+static bool rejects(uint32_t level) {
+    try {
+        B buddy(level);
+        return false;
+    } catch (std::invalid_argument&) {
+        return true;
+    }
+}
+
+static void level_limits() {
+    typedef BasicBuddy<uint32_t, SparseTree<uint32_t> > Sparse32;
+    typedef BasicBuddy<uint64_t, SparseTree<uint64_t> > Sparse64;
+
+    assert(rejects<Buddy>(31) && rejects<Buddy>(40));
+    assert(rejects<Sparse32>(32));
+    assert(rejects<Sparse64>(64));
+    assert(rejects<BasicBuddy<uint64_t> >(63));
+
+    Sparse32 top(31);
+    assert(top.alloc(1) == 0 && top.alloc(1u << 30) == 1u << 30);
+    Sparse64 wide(63);
+    assert(wide.alloc(1) == 0);
+}
+
+static void heap_limits() {
+    BuddyHeap heap(4, 4096);
+    assert(heap.alloc((size_t)-1) == 0);
+    assert(heap.alloc((size_t)-4096) == 0);
+    assert(heap.alloc(16 * 4096 + 1) == 0);
+
+    void* all = heap.alloc(16 * 4096);
+    assert(all && heap.size(all) == 16 * 4096);
+    heap.free(all);
+}
+
+int main() {
+    random_ops<Buddy>(40, 12);
+    random_ops<BasicBuddy<uint64_t> >(20, 12);
+    random_ops<BasicBuddy<uint32_t, SparseTree<uint32_t> > >(20, 14);
+    random_ops<BasicBuddy<uint64_t, SparseTree<uint64_t> > >(20, 14);
+    interior_offsets();
+    huge_arena();
+    sparse_pages();
+    level_limits();
+    heap_limits();
+
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,810 @@
+/*
+ *    g++ -std=c++11 -O2 -I.. threadpool_test.cc -o threadpool_test -pthread && ./threadpool_test
+ *    g++ -std=c++20 -O2 -I.. threadpool_test.cc -o threadpool_test -pthread && ./threadpool_test
+ *
+ *    WorkDeque and the scheduler under load. Meant to be run under
+ *    -fsanitize=thread as well: the deque test has one owner pushing and
+ *    popping while thieves steal, and every item must come out once.
+ *    The second line also builds the coroutine tests.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../threadpool.h"
+
+static void deque_single() {
+    WorkDeque<int> deque(2);
+    std::vector<int> items(1000);
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i] = (int)i;
+        deque.push(&items[i]);
+    }
+
+    assert(*deque.steal() == 0);
+    for (int i = 999; i > 0; --i) {
+        assert(*deque.pop() == i);
+    }
+
+    assert(deque.empty() && !deque.pop() && !deque.steal());
+}
+
+static void deque_stress(int thieves) {
+    enum { COUNT = 200000 };
+
+    WorkDeque<int> deque(2);
+    std::vector<int> items(COUNT);
+    std::vector<std::atomic<int> > seen(COUNT);
+    std::atomic<bool> done(false);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thieves; ++t) {
+        threads.push_back(std::thread([&] {
+            while (!done.load() || !deque.empty()) {
+                if (int* item = deque.steal()) {
+                    ++seen[*item];
+                }
+            }
+        }));
+    }
+
+    for (int i = 0; i < COUNT; ++i) {
+        items[i] = i;
+        deque.push(&items[i]);
+        if (i % 3 == 0) {
+            if (int* item = deque.pop()) {
+                ++seen[*item];
+            }
+        }
+    }
+
+    while (int* item = deque.pop()) {
+        ++seen[*item];
+    }
+
+    done = true;
+    for (size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+
+    for (int i = 0; i < COUNT; ++i) {
+        assert(seen[i] == 1);
+    }
+}
+
+static std::atomic<long> spawned(0);
+
+static void spawn(ThreadPool& pool, int depth) {
+    ++spawned;
+    if (depth > 0) {
+        pool.enqueue(spawn, std::ref(pool), depth - 1);
+        pool.enqueue(spawn, std::ref(pool), depth - 1);
+    }
+}
+
+static void pool_enqueue(size_t threads) {
+    {
+        ThreadPool pool(threads);
+        std::vector<std::future<int> > results;
+        for (int i = 0; i < 10000; ++i) {
+            results.push_back(pool.enqueue([](int x) { return x * 2; }, i));
+        }
+
+        for (int i = 0; i < 10000; ++i) {
+            assert(results[i].get() == i * 2);
+        }
+
+        std::future<int> error = pool.enqueue([]() -> int { throw std::runtime_error("boom"); });
+        try {
+            error.get();
+            assert(0);
+        } catch (std::runtime_error&) {
+        }
+
+        spawned = 0;
+        pool.enqueue(spawn, std::ref(pool), 14).get();
+    }
+
+    assert(spawned == (1 << 15) - 1);
+}
+
+struct Big {
+    char pad[200];
+    int value;
+};
+
+static void pool_post() {
+    ThreadPool pool(4);
+    std::atomic<int> count(0);
+    for (int i = 0; i < 100000; ++i) {
+        pool.post([&count] { ++count; });
+    }
+
+    std::vector<PooledFuture<int> > results;
+    for (int i = 0; i < 10000; ++i) {
+        results.push_back(pool.submit([i] { return i * 3; }));
+    }
+
+    for (int i = 0; i < 10000; ++i) {
+        assert(results[i].get() == i * 3);
+    }
+
+    assert(pool.submit([] { return std::string(100, 'x'); }).get().size() == 100);
+    pool.submit([&count] { ++count; }).get();
+
+    PooledFuture<int> error = pool.submit([]() -> int { throw std::runtime_error("boom"); });
+    try {
+        error.get();
+        assert(0);
+    } catch (std::runtime_error&) {
+    }
+
+    Big big;
+    big.value = 7;
+    assert(pool.submit([big] { return big.value; }).get() == 7);
+
+    PooledFuture<int> dropped = pool.submit([] { return 1; });
+
+    PooledFuture<int> broken;
+    {
+        PooledPromise<int> promise;
+        broken = promise.get_future();
+    }
+
+    try {
+        broken.get();
+        assert(0);
+    } catch (std::future_error&) {
+    }
+
+    Task task([] {});
+    Task moved(std::move(task));
+    assert(!task && moved);
+    moved();
+
+    pool.submit([] {}).get();
+    assert(count == 100001);
+}
+
+static void pool_loops() {
+    ThreadPool pool(4);
+    const int n = 1 << 18;
+    std::vector<int> v(n);
+    pool.parallel_for(0, n, [&](int i) { v[i] = i; });
+    for (int i = 0; i < n; ++i) {
+        assert(v[i] == i);
+    }
+
+    long sum = pool.parallel_reduce(0, n, 0L, [&](int i) { return (long)v[i]; }, std::plus<long>());
+    assert(sum == (long)n * (n - 1) / 2);
+    assert(pool.parallel_reduce(0, 0, 5L, [](int) { return 1L; }, std::plus<long>()) == 5);
+
+    std::atomic<long> count(0);
+    pool.parallel_for(0, 100, [&](int) {
+        pool.parallel_for(0, 1000, [&](int) { count.fetch_add(1, std::memory_order_relaxed); });
+    });
+    assert(count == 100000);
+
+    try {
+        pool.parallel_for(0, 10000, [](int i) {
+            if (i == 777) {
+                throw std::runtime_error("boom");
+            }
+        });
+        assert(0);
+    } catch (std::runtime_error&) {
+    }
+
+    pool.submit([&] { pool.parallel_for(0, 1000, [&](int i) { v[i] = -i; }); }).get();
+    assert(v[999] == -999);
+}
+
+static void graph_layers(ThreadPool& pool, TaskGraph& graph, std::vector<std::atomic<int> >& stamp, std::atomic<int>& clock) {
+    enum { LAYERS = 20, WIDTH = 8 };
+
+    clock = 0;
+    graph.run(pool);
+    assert(clock == LAYERS * WIDTH);
+    for (int l = 1; l < LAYERS; ++l) {
+        for (int w = 0; w < WIDTH; ++w) {
+            assert(stamp[l * WIDTH + w] > stamp[(l - 1) * WIDTH + w]);
+            assert(stamp[l * WIDTH + w] > stamp[(l - 1) * WIDTH + (w + 1) % WIDTH]);
+        }
+    }
+}
+
+static void pool_graph() {
+    enum { LAYERS = 20, WIDTH = 8 };
+
+    ThreadPool pool(4);
+    TaskGraph graph;
+    std::vector<std::atomic<int> > stamp(LAYERS * WIDTH);
+    std::atomic<int> clock(0);
+    std::vector<size_t> ids;
+    for (int l = 0; l < LAYERS; ++l) {
+        for (int w = 0; w < WIDTH; ++w) {
+            ids.push_back(graph.add([&, l, w] { stamp[l * WIDTH + w] = ++clock; }));
+        }
+    }
+
+    for (int l = 1; l < LAYERS; ++l) {
+        for (int w = 0; w < WIDTH; ++w) {
+            graph.precede(ids[(l - 1) * WIDTH + w], ids[l * WIDTH + w]);
+            graph.precede(ids[(l - 1) * WIDTH + (w + 1) % WIDTH], ids[l * WIDTH + w]);
+        }
+    }
+
+    assert(graph.size() == LAYERS * WIDTH);
+    for (int r = 0; r < 500; ++r) {
+        graph_layers(pool, graph, stamp, clock);
+    }
+
+    pool.submit([&] { graph_layers(pool, graph, stamp, clock); }).get();
+
+    std::atomic<bool> after(false);
+    TaskGraph failing;
+    size_t a = failing.add([] { throw std::runtime_error("boom"); });
+    size_t b = failing.add([&after] { after = true; });
+    failing.precede(a, b);
+    for (int r = 0; r < 2; ++r) {
+        try {
+            failing.run(pool);
+            assert(0);
+        } catch (std::runtime_error&) {
+        }
+    }
+
+    assert(!after);
+
+    TaskGraph cycle;
+    size_t x = cycle.add([] {});
+    size_t y = cycle.add([] {});
+    cycle.precede(x, y);
+    cycle.precede(y, x);
+    try {
+        cycle.run(pool);
+        assert(0);
+    } catch (std::logic_error&) {
+    }
+
+    try {
+        cycle.precede(x, 7);
+        assert(0);
+    } catch (std::out_of_range&) {
+    }
+
+    TaskGraph empty;
+    empty.run(pool);
+}
+
+static void pool_groups() {
+    std::vector<ThreadPool::Group> numa = ThreadPool::numa_groups(2, true);
+    assert(!numa.empty() && numa[0].threads == 2 && numa[0].pin);
+
+    std::vector<ThreadPool::Group> groups(3);
+    groups[0].threads = 2;
+    groups[0].cpus.push_back(0);
+    groups[0].pin = true;
+    groups[1].threads = 3;
+    groups[2].threads = 1;
+    groups[2].cpus.push_back(0);
+
+    ThreadPool pool(groups);
+    assert(pool.size() == 6 && pool.groups() == 3);
+
+    std::mutex mutex;
+    std::set<std::thread::id> ids[3];
+    std::atomic<int> count(0);
+    for (int i = 0; i < 3000; ++i) {
+        int group = i % 3;
+        pool.post_to(group, [&, group] {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ids[group].insert(std::this_thread::get_id());
+            }
+
+            ++count;
+        });
+    }
+
+    while (count.load() < 3000) {
+        std::this_thread::yield();
+    }
+
+    for (int a = 0; a < 3; ++a) {
+        assert(!ids[a].empty());
+        for (int b = a + 1; b < 3; ++b) {
+            for (std::set<std::thread::id>::iterator it = ids[a].begin(); it != ids[a].end(); ++it) {
+                assert(!ids[b].count(*it));
+            }
+        }
+    }
+
+    assert(ids[2].size() == 1);
+    assert(pool.enqueue_to(1, [](int x) { return x + 1; }, 1).get() == 2);
+
+    std::shared_ptr<int> held(new int(0));
+    try {
+        pool.post_to(7, [held] {});
+        assert(0);
+    } catch (std::out_of_range&) {
+    }
+
+    assert(held.use_count() == 1);
+
+    long sum = pool.parallel_reduce(0, 100000, 0L, [](int i) { return (long)i; }, std::plus<long>());
+    assert(sum == 100000L * 99999 / 2);
+}
+
+struct Flaky {
+    Flaky(std::atomic<int>& count, bool fail) : _count(count), _fail(fail) {}
+
+    Flaky(Flaky&& other) : _count(other._count), _fail(other._fail) {
+        if (_fail) {
+            throw std::runtime_error("move");
+        }
+    }
+
+    void operator()() {
+        ++_count;
+    }
+
+    std::atomic<int>& _count;
+    bool _fail;
+};
+
+static bool reaches(std::atomic<int>& count, int want) {
+    for (int i = 0; i < 2000 && count.load() < want; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return count.load() == want;
+}
+
+static void batch_throws() {
+    ThreadPool pool(1);
+    std::atomic<int> count(0);
+    std::vector<Flaky> tasks;
+    tasks.reserve(3);
+    tasks.emplace_back(count, false);
+    tasks.emplace_back(count, false);
+    tasks.emplace_back(count, true);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    try {
+        pool.enqueue_batch(std::make_move_iterator(tasks.begin()), std::make_move_iterator(tasks.end()));
+        assert(0);
+    } catch (std::runtime_error&) {
+    }
+
+    assert(reaches(count, 2));
+
+    pool.submit([&] {
+        try {
+            pool.enqueue_batch(std::make_move_iterator(tasks.begin()), std::make_move_iterator(tasks.end()));
+            assert(0);
+        } catch (std::runtime_error&) {
+        }
+    }).get();
+
+    assert(reaches(count, 4));
+}
+
+static void pool_batch() {
+    ThreadPool pool(4);
+    std::atomic<int> count(0);
+    std::vector<std::function<void()> > tasks(1000, [&count] { ++count; });
+    pool.enqueue_batch(tasks);
+
+    pool.submit([&] {
+        std::vector<std::function<void()> > inner(100, [&count] { ++count; });
+        pool.enqueue_batch(inner.begin(), inner.end());
+    }).get();
+
+    std::vector<std::function<void()> > targeted(10, [&count] { ++count; });
+    pool.enqueue_batch(targeted, 0);
+    std::vector<std::function<void()> > none;
+    pool.enqueue_batch(none);
+
+    while (count.load() < 1110) {
+        std::this_thread::yield();
+    }
+
+    pool.set_idle_policy(1000, 10);
+    for (int i = 0; i < 10000; ++i) {
+        pool.post([&count] { ++count; });
+    }
+
+    while (count.load() < 11110) {
+        std::this_thread::yield();
+    }
+
+    pool.set_idle_policy(0, 0);
+    pool.parallel_for(0, 1000, [](int) {});
+    assert(pool.submit([] { return 5; }).get() == 5);
+}
+
+class Json {
+public:
+    Json(const std::string& text) : _p(text.c_str()) {}
+
+    bool valid() {
+        return _value() && (_space(), *_p == 0);
+    }
+
+private:
+    void _space() {
+        while (*_p == ' ' || *_p == '\n' || *_p == '\r' || *_p == '\t') {
+            ++_p;
+        }
+    }
+
+    bool _literal(const char* word) {
+        size_t n = strlen(word);
+        if (strncmp(_p, word, n) != 0) {
+            return false;
+        }
+
+        _p += n;
+        return true;
+    }
+
+    bool _string() {
+        if (*_p++ != '"') {
+            return false;
+        }
+
+        while (*_p && *_p != '"') {
+            if (*_p++ == '\\' && !*_p++) {
+                return false;
+            }
+        }
+
+        return *_p++ == '"';
+    }
+
+    bool _number() {
+        const char* start = _p;
+        strtod(_p, (char**)&_p);
+        return _p != start;
+    }
+
+    template<class Item>
+    bool _list(char close, Item item) {
+        ++_p;
+        _space();
+        if (*_p == close) {
+            ++_p;
+            return true;
+        }
+
+        for (;;) {
+            if (!item()) {
+                return false;
+            }
+
+            _space();
+            if (*_p == close) {
+                ++_p;
+                return true;
+            }
+
+            if (*_p++ != ',') {
+                return false;
+            }
+
+            _space();
+        }
+    }
+
+    bool _value() {
+        _space();
+        switch (*_p) {
+        case '{':
+            return _list('}', [this] { return _string() && (_space(), *_p++ == ':') && _value(); });
+        case '[':
+            return _list(']', [this] { return _value(); });
+        case '"':
+            return _string();
+        case 't':
+            return _literal("true");
+        case 'f':
+            return _literal("false");
+        case 'n':
+            return _literal("null");
+        default:
+            return _number();
+        }
+    }
+
+    const char* _p;
+};
+
+static void pool_metrics() {
+    enum { COUNT = 5000 };
+
+    ThreadPool pool(2);
+    pool.set_metrics(true);
+    pool.start_trace();
+    std::atomic<int> count(0);
+    for (int i = 0; i < COUNT; ++i) {
+        pool.post([&count] { ++count; });
+    }
+
+    uint64_t total = 0;
+    ThreadPool::Snapshot snap;
+    while (total < COUNT) {
+        std::this_thread::yield();
+        snap = pool.snapshot();
+        total = snap.outside_tasks;
+        for (size_t i = 0; i < snap.workers.size(); ++i) {
+            total += snap.workers[i].tasks;
+        }
+    }
+
+    assert(total == COUNT && count == COUNT);
+    assert(snap.workers.size() == 2 && snap.queued == 0);
+
+    uint64_t runs = 0;
+    for (size_t i = 0; i < ThreadPool::BUCKET_CNT; ++i) {
+        runs += snap.run[i];
+    }
+
+    assert(runs == COUNT);
+    pool.stop_trace();
+
+    FILE* file = tmpfile();
+    pool.write_trace(file);
+    std::string text(ftell(file), '\0');
+    rewind(file);
+    assert(fread(&text[0], 1, text.size(), file) == text.size());
+    fclose(file);
+
+    assert(Json(text).valid());
+    size_t events = 0;
+    for (size_t at = text.find("\"ph\":\"X\""); at != std::string::npos; at = text.find("\"ph\":\"X\"", at + 1)) {
+        ++events;
+    }
+
+    assert(events == COUNT);
+    assert(!Json("{\"a\":[1,2,]}").valid() && !Json("{\"a\" 1}").valid());
+
+    file = tmpfile();
+    pool.dump(file);
+    assert(ftell(file) > 0);
+    fclose(file);
+}
+
+static void unrelated() {
+    throw std::runtime_error("unrelated");
+}
+
+template<class Wait>
+static bool aborts(Wait wait) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        ThreadPool pool(1);
+        std::atomic<bool> started(false);
+        std::atomic<bool> release(false);
+        pool.post([&] {
+            started = true;
+            while (!release.load()) {
+                std::this_thread::yield();
+            }
+        });
+
+        while (!started.load()) {
+            std::this_thread::yield();
+        }
+
+        try {
+            wait(pool);
+        } catch (...) {
+        }
+
+        release = true;
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+static void help_throws() {
+    assert(aborts([](ThreadPool& pool) {
+        pool.parallel_for(0, 1 << 16, [&pool](int i) {
+            if (i == 0) {
+                pool.post_priority(ThreadPool::PRIORITY_HIGH, unrelated);
+            }
+        });
+    }));
+
+    assert(aborts([](ThreadPool& pool) {
+        pool.post(unrelated);
+        TaskGraph graph;
+        size_t a = graph.add([] {});
+        size_t b = graph.add([] {});
+        graph.precede(a, b);
+        graph.run(pool);
+    }));
+}
+
+static void deque_not_starved() {
+    ThreadPool pool(1);
+    std::atomic<int> high(0);
+    std::atomic<int> seen(-1);
+    pool.submit([&] {
+        pool.post([&] { seen = high.load(); });
+        for (int i = 0; i < 1000; ++i) {
+            pool.post_priority(ThreadPool::PRIORITY_HIGH, [&high] { ++high; });
+        }
+    }).get();
+
+    while (seen.load() < 0) {
+        std::this_thread::yield();
+    }
+
+    assert(seen < 16);
+}
+
+#ifdef __cpp_impl_coroutine
+static CoTask<int> square(ThreadPool& pool, int x) {
+    co_await pool.schedule();
+    co_return x * x;
+}
+
+static CoTask<int> plain(int x) {
+    co_return x;
+}
+
+static CoTask<int> fail(ThreadPool& pool) {
+    co_await pool.schedule();
+    throw std::runtime_error("fail");
+}
+
+static CoTask<void> bump(ThreadPool& pool, std::atomic<int>& count) {
+    co_await pool.schedule();
+    ++count;
+}
+
+static CoTask<long> fan(ThreadPool& pool, int width) {
+    std::vector<CoTask<int> > parts;
+    for (int i = 0; i < width; ++i) {
+        parts.push_back(square(pool, i));
+    }
+
+    std::vector<int> results = co_await when_all(std::move(parts));
+    long sum = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        assert(results[i] == (int)(i * i));
+        sum += results[i];
+    }
+
+    co_return sum;
+}
+
+static CoTask<long> tree(ThreadPool& pool, int depth) {
+    co_await pool.schedule();
+    if (depth == 0) {
+        co_return 1;
+    }
+
+    std::vector<CoTask<long> > kids;
+    kids.push_back(tree(pool, depth - 1));
+    kids.push_back(tree(pool, depth - 1));
+    std::vector<long> results = co_await when_all(std::move(kids));
+    co_return results[0] + results[1];
+}
+
+static CoTask<std::string> text() {
+    co_return std::string(100, 'a');
+}
+
+static CoTask<std::thread::id> hop(ThreadPool& pool, size_t group) {
+    co_await pool.schedule(group);
+    co_return std::this_thread::get_id();
+}
+
+static void coroutines() {
+    ThreadPool pool(4);
+    assert(sync_wait(square(pool, 7)) == 49);
+    assert(sync_wait(text()) == std::string(100, 'a'));
+
+    long want = 0;
+    for (int i = 0; i < 1000; ++i) {
+        want += (long)i * i;
+    }
+
+    for (int r = 0; r < 20; ++r) {
+        assert(sync_wait(fan(pool, 1000)) == want);
+    }
+
+    assert(sync_wait(tree(pool, 12)) == 4096);
+
+    std::vector<CoTask<int> > inline_parts;
+    for (int i = 0; i < 100; ++i) {
+        inline_parts.push_back(plain(i));
+    }
+
+    std::vector<int> values = sync_wait(when_all(std::move(inline_parts)));
+    assert(values.size() == 100 && values[0] == 0 && values[99] == 99);
+
+    std::atomic<int> count(0);
+    std::vector<CoTask<void> > voids;
+    for (int i = 0; i < 100; ++i) {
+        voids.push_back(bump(pool, count));
+    }
+
+    sync_wait(when_all(std::move(voids)));
+    assert(count.load() == 100);
+    sync_wait(when_all(std::vector<CoTask<void> >()));
+    assert(sync_wait(when_all(std::vector<CoTask<int> >())).empty());
+
+    for (int r = 0; r < 20; ++r) {
+        std::vector<CoTask<int> > parts;
+        parts.push_back(square(pool, 1));
+        parts.push_back(fail(pool));
+        parts.push_back(square(pool, 2));
+        try {
+            sync_wait(when_all(std::move(parts)));
+            assert(0);
+        } catch (std::runtime_error& e) {
+            assert(strcmp(e.what(), "fail") == 0);
+        }
+    }
+
+    {
+        CoTask<int> unused = square(pool, 3);
+    }
+
+    std::vector<ThreadPool::Group> groups(2);
+    groups[0].threads = 1;
+    groups[1].threads = 1;
+    ThreadPool grouped(groups);
+    std::thread::id ids[2];
+    for (size_t g = 0; g < 2; ++g) {
+        ids[g] = grouped.enqueue_to(g, [] { return std::this_thread::get_id(); }).get();
+        assert(sync_wait(hop(grouped, g)) == ids[g]);
+    }
+
+    assert(ids[0] != ids[1]);
+}
+#endif
+
+int main() {
+    deque_single();
+    deque_stress(1);
+    deque_stress(3);
+    pool_enqueue(1);
+    pool_enqueue(4);
+    pool_post();
+    pool_loops();
+    pool_graph();
+    pool_groups();
+    pool_batch();
+    batch_throws();
+    pool_metrics();
+    help_throws();
+    deque_not_starved();
+#ifdef __cpp_impl_coroutine
+    coroutines();
+#endif
+
+    puts("ok");
+    return 0;
+}
@@ -1,96 +1,2756 @@
 #ifndef __THREAD_POOL_H__
 #define __THREAD_POOL_H__
 
+#include <stdint.h>
+#include <stdio.h>
 #include <vector>
 #include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <exception>
+#include <type_traits>
+#include <algorithm>
+#include <chrono>
+#ifdef __linux__
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+#include "allocator.h"
 
-class ThreadPool {
+/*
+ *    ThreadPool pool(8);
+ *    std::future<int> f = pool.enqueue([](int x) { return x * 2; }, 21);
+ *
+ *    Every worker owns a Chase-Lev deque. A task enqueued by a worker of
+ *    the pool goes to the bottom of that worker's deque and is popped
+ *    from there LIFO; a task enqueued from any other thread goes to a
+ *    shared queue. A worker with nothing local takes from the shared
+ *    queue, then steals from the top of the other deques starting at a
+ *    random one, and sleeps on the condition only when every queue is
+ *    empty. The destructor runs all queued tasks before it joins.
+ *
+ *    ThreadPool numa(ThreadPool::numa_groups(0, true));
+ *    numa.post_to(1, [] { ... });
+ *
+ *    Workers come in groups, each with its own shared queue, mutex and
+ *    condition; ThreadPool(n) is one group of n unpinned workers. A
+ *    Group restricts its workers to a cpu set, or with pin binds each to
+ *    one cpu of it in turn; numa_groups() builds one group per node from
+ *    /sys/devices/system/node, or one unrestricted group where that is
+ *    missing. enqueue_to and post_to queue on a group's shared queue,
+ *    which only that group's workers take from; enqueue and post from
+ *    outside the pool spread over the groups in turn. Idle workers steal
+ *    inside their group before they steal across groups. A thread
+ *    outside the pool that helps in parallel_for or TaskGraph::run may
+ *    take from any group's queue.
+ *
+ *    pool.set_idle_policy(200, 20);
+ *    pool.enqueue_batch(tasks);
+ *
+ *    A worker that finds nothing polls again spins times with a cpu
+ *    pause in between, then yields times, then sleeps on its group's
+ *    condition; both default to 0, straight to sleep. enqueue_batch
+ *    moves every callable of a range into one queue under one lock and
+ *    wakes at most as many sleeping workers as it queued; if moving one
+ *    throws, the ones before it stay queued and are woken for.
+ *
+ *    pool.post_priority(ThreadPool::PRIORITY_HIGH, [] { ... });
+ *
+ *    Each group's shared queue has a FIFO per priority. HIGH and LOW
+ *    tasks always go there, NORMAL tasks from a worker still go to its
+ *    deque. A worker looks at its group's HIGH queue before its own
+ *    deque and takes the highest non-empty level otherwise. Against
+ *    starvation, every STARVE_CNT-th take from a group queue serves the
+ *    lowest non-empty level, and every STARVE_CNT-th look of a worker
+ *    skips the HIGH check and pops its deque first, so NORMAL work
+ *    queued from inside a task moves too.
+ *
+ *    pool.post([&counter] { ++counter; });
+ *    PooledFuture<int> r = pool.submit([] { return 42; });
+ *    int v = r.get();
+ *
+ *    Queued work is a Task, a move-only callable that keeps functors of
+ *    up to Task::INLINE_SIZE bytes in place and boxes larger ones. Task
+ *    nodes come from ObjectPool and the shared state of a PooledFuture
+ *    from Allocator, so post() of a small lambda, and submit() of one
+ *    returning a small value, take memory only from the thread's own
+ *    free lists. post() has no result; a task that throws terminates.
+ *    enqueue() still returns a std::future.
+ *
+ *    pool.parallel_for(0, n, [&](int i) { out[i] = f(in[i]); });
+ *    long sum = pool.parallel_reduce(0, n, 0L, [&](int i) { return (long)in[i]; }, std::plus<long>());
+ *
+ *    Loops split lazily: a thread runs grain iterations at a time and
+ *    hands the upper half of what is left to the pool only when its own
+ *    deque is empty, or for a thread outside the pool, when the shared
+ *    queue is. The calling thread works on the loop and then runs queued
+ *    tasks until every part is done, so it never just blocks; a queued
+ *    task that throws there terminates, as it would on a worker. reduce
+ *    must be associative and commutative, partial results are combined
+ *    in the order the parts finish. The first exception is rethrown.
+ *
+ *    pool.set_metrics(true);
+ *    pool.dump(stderr);
+ *    pool.start_trace();
+ *    ...
+ *    pool.stop_trace();
+ *    pool.write_trace(fopen("pool.json", "w"));
+ *
+ *    Every worker counts the tasks it ran and stole in counters only it
+ *    writes; tasks run by threads outside the pool while they help share
+ *    one set of counters. With set_metrics(true) a task is stamped when
+ *    it is queued, and the thread that runs it also adds its busy time,
+ *    the idle periods between tasks and log2 histograms of queue wait and
+ *    run time, bucket i counting from 2^i ns. snapshot() adds the
+ *    counters up with the current queue depths when it is called, dump()
+ *    prints them. start_trace() turns metrics on and keeps up to limit
+ *    tasks per thread; write_trace() writes them as Chrome trace-event
+ *    JSON, one track per worker, for chrome://tracing or Perfetto.
+ *
+ *    TaskGraph graph;
+ *    size_t load = graph.add([&] { ... });
+ *    size_t parse = graph.add([&] { ... });
+ *    graph.precede(load, parse);
+ *    graph.run(pool);
+ *
+ *    A TaskGraph keeps its nodes and edges between runs. run() resets
+ *    every node's count of unfinished predecessors, posts the nodes that
+ *    have none and, like the loops above, has the caller run queued
+ *    tasks until the graph is done. A finished node counts down its
+ *    successors; it goes on with the first one that becomes ready on the
+ *    same thread and posts the others, so no worker waits on another; a
+ *    node that can't be posted runs on the spot.
+ *    After a node throws the remaining nodes are skipped and run()
+ *    rethrows. A graph with a cycle throws std::logic_error, and a
+ *    graph must not be run twice at the same time.
+ *
+ *    CoTask<int> square(ThreadPool& pool, int x) {
+ *        co_await pool.schedule();
+ *        co_return x * x;
+ *    }
+ *    std::vector<int> all = sync_wait(when_all(std::move(parts)));
+ *
+ *    With coroutine support, co_await pool.schedule() posts the rest of
+ *    the coroutine to the pool (to a group with schedule(group)). A
+ *    CoTask starts when it is awaited and resumes its awaiter on the
+ *    thread that finishes it, so a suspended coroutine holds no thread.
+ *    when_all starts every task of a vector before it suspends and
+ *    yields their results in order, or rethrows the first exception;
+ *    tasks that never schedule run one after another on the caller.
+ *    sync_wait blocks a thread outside the pool until a task is done.
+ *    Frames come from Allocator. T must be void or an object type.
+ */
+
+class Task {
 public:
-    ThreadPool(size_t threads);
+    enum {
+        INLINE_SIZE = 48
+    };
 
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
+    Task();
+    template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f);
+    Task(Task&& other) noexcept;
+    Task& operator=(Task&& other) noexcept;
+    ~Task();
 
-    ~ThreadPool();
+    void operator()();
+    explicit operator bool() const;
 
 private:
-    std::vector<std::thread> _workers;
-    std::queue<std::function<void()>> _tasks;
-    std::mutex _queue_mutex;
+    friend class ThreadPool;
+
+    Task(const Task&);
+    Task& operator=(const Task&);
+
+    struct Ops {
+        void (*_call)(void* p);
+        void (*_move)(void* to, void* from);
+        void (*_destroy)(void* p);
+    };
+
+    template<typename F>
+    struct Inline {
+        static void call(void* p);
+        static void move(void* to, void* from);
+        static void destroy(void* p);
+        static const Ops ops;
+    };
+
+    template<typename F>
+    struct Boxed {
+        static void call(void* p);
+        static void move(void* to, void* from);
+        static void destroy(void* p);
+        static const Ops ops;
+    };
+
+    template<typename F>
+    void _init(F&& f, std::true_type);
+    template<typename F>
+    void _init(F&& f, std::false_type);
+    void _reset();
+
+    typename std::aligned_storage<INLINE_SIZE, alignof(max_align_t)>::type _storage;
+    const Ops* _ops;
+    uint64_t _queued;
+};
+
+template<typename F>
+const typename Task::Ops Task::Inline<F>::ops = { &Task::Inline<F>::call, &Task::Inline<F>::move, &Task::Inline<F>::destroy };
+
+template<typename F>
+const typename Task::Ops Task::Boxed<F>::ops = { &Task::Boxed<F>::call, &Task::Boxed<F>::move, &Task::Boxed<F>::destroy };
+
+template<typename F>
+void Task::Inline<F>::call(void* p)
+{
+    (*(F*)p)();
+}
+
+template<typename F>
+void Task::Inline<F>::move(void* to, void* from)
+{
+    new (to) F(std::move(*(F*)from));
+    ((F*)from)->~F();
+}
+
+template<typename F>
+void Task::Inline<F>::destroy(void* p)
+{
+    ((F*)p)->~F();
+}
+
+template<typename F>
+void Task::Boxed<F>::call(void* p)
+{
+    (**(F**)p)();
+}
+
+template<typename F>
+void Task::Boxed<F>::move(void* to, void* from)
+{
+    *(F**)to = *(F**)from;
+}
+
+template<typename F>
+void Task::Boxed<F>::destroy(void* p)
+{
+    delete *(F**)p;
+}
+
+inline Task::Task() : _ops(0), _queued(0)
+{
+}
+
+template<typename F, typename>
+Task::Task(F&& f) : _ops(0), _queued(0)
+{
+    typedef typename std::decay<F>::type Func;
+    _init(std::forward<F>(f), std::integral_constant<bool,
+        sizeof(Func) <= INLINE_SIZE && alignof(Func) <= alignof(max_align_t) && std::is_nothrow_move_constructible<Func>::value>());
+}
+
+template<typename F>
+void Task::_init(F&& f, std::true_type)
+{
+    typedef typename std::decay<F>::type Func;
+    new (&_storage) Func(std::forward<F>(f));
+    _ops = &Inline<Func>::ops;
+}
+
+template<typename F>
+void Task::_init(F&& f, std::false_type)
+{
+    typedef typename std::decay<F>::type Func;
+    *(Func**)&_storage = new Func(std::forward<F>(f));
+    _ops = &Boxed<Func>::ops;
+}
+
+inline Task::Task(Task&& other) noexcept : _ops(other._ops), _queued(other._queued)
+{
+    if (_ops) {
+        _ops->_move(&_storage, &other._storage);
+        other._ops = 0;
+    }
+}
+
+inline Task& Task::operator=(Task&& other) noexcept
+{
+    if (this != &other) {
+        _reset();
+        _ops = other._ops;
+        _queued = other._queued;
+        if (_ops) {
+            _ops->_move(&_storage, &other._storage);
+            other._ops = 0;
+        }
+    }
+
+    return *this;
+}
+
+inline Task::~Task()
+{
+    _reset();
+}
+
+inline void Task::_reset()
+{
+    if (_ops) {
+        _ops->_destroy(&_storage);
+        _ops = 0;
+    }
+}
+
+inline void Task::operator()()
+{
+    _ops->_call(&_storage);
+}
+
+inline Task::operator bool() const
+{
+    return _ops != 0;
+}
+
+template<typename T>
+class FutureState {
+public:
+    typedef typename std::conditional<std::is_void<T>::value, char, T>::type Value;
+
+    static FutureState* create();
+    void retain();
+    void release();
+
+    void wait();
+    bool ready();
+    void set_error(std::exception_ptr error);
+    template<typename... U>
+    void set_value(U&&... value);
+    Value& value();
+    std::exception_ptr error() const;
+
+private:
+    FutureState();
+    ~FutureState();
+
+    std::mutex _mutex;
     std::condition_variable _condition;
-    bool _stop;
+    std::atomic<int> _refs;
+    std::atomic<bool> _ready;
+    bool _has_value;
+    std::exception_ptr _error;
+    typename std::aligned_storage<sizeof(Value), alignof(Value)>::type _value;
 };
 
-inline ThreadPool::ThreadPool(size_t threads) : _stop(false)
-{
-    for (size_t i = 0; i < threads; ++i) {
-        _workers.emplace_back(
-            [this] {
-                for (;;) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->_queue_mutex);
-                        this->_condition.wait(lock,
-                            [this] {
-                                return this->_stop || !this->_tasks.empty();
-                            }
-                        );
-
-                        if (this->_stop && this->_tasks.empty())
-                            return;
-
-                        task = std::move(this->_tasks.front());
-                        this->_tasks.pop();
-                    }
-                    task();
-                }
-            }
-        );
+template<typename T>
+FutureState<T>::FutureState() : _refs(2), _ready(false), _has_value(false)
+{
+}
+
+template<typename T>
+FutureState<T>::~FutureState()
+{
+    if (_has_value) {
+        value().~Value();
     }
 }
 
-template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>
+template<typename T>
+FutureState<T>* FutureState<T>::create()
 {
-    using return_type = typename std::result_of<F(Args...)>::type;
+    void* p = Allocator<16>::alloc(sizeof(FutureState));
+    if (!p) {
+        throw std::bad_alloc();
+    }
 
-    auto task = std::make_shared<std::packaged_task<return_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    return new (p) FutureState();
+}
 
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(_queue_mutex);
+template<typename T>
+void FutureState<T>::retain()
+{
+    _refs.fetch_add(1, std::memory_order_relaxed);
+}
 
-        if(_stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
+template<typename T>
+void FutureState<T>::release()
+{
+    if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        this->~FutureState();
+        Allocator<16>::free(this);
+    }
+}
 
-        _tasks.emplace(
-            [task] {
-                (*task)();
-            }
-        );
+template<typename T>
+bool FutureState<T>::ready()
+{
+    return _ready.load(std::memory_order_acquire);
+}
+
+template<typename T>
+void FutureState<T>::wait()
+{
+    if (ready()) {
+        return;
     }
-    _condition.notify_one();
 
-    return res;
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock,
+        [this] {
+            return this->ready();
+        }
+    );
 }
 
-inline ThreadPool::~ThreadPool()
+template<typename T>
+template<typename... U>
+void FutureState<T>::set_value(U&&... value)
 {
+    new (&_value) Value(std::forward<U>(value)...);
+    _has_value = true;
     {
-        std::unique_lock<std::mutex> lock(_queue_mutex);
-        _stop = true;
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.store(true, std::memory_order_release);
     }
     _condition.notify_all();
+}
 
-    for (std::thread& worker : _workers) {
-        worker.join();
+template<typename T>
+void FutureState<T>::set_error(std::exception_ptr error)
+{
+    _error = error;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.store(true, std::memory_order_release);
+    }
+    _condition.notify_all();
+}
+
+template<typename T>
+typename FutureState<T>::Value& FutureState<T>::value()
+{
+    return *(Value*)&_value;
+}
+
+template<typename T>
+std::exception_ptr FutureState<T>::error() const
+{
+    return _error;
+}
+
+template<typename T>
+class PooledFuture {
+public:
+    PooledFuture();
+    explicit PooledFuture(FutureState<T>* state);
+    PooledFuture(PooledFuture&& other) noexcept;
+    PooledFuture& operator=(PooledFuture&& other) noexcept;
+    ~PooledFuture();
+
+    bool valid() const;
+    bool ready() const;
+    void wait() const;
+    T get();
+
+private:
+    PooledFuture(const PooledFuture&);
+    PooledFuture& operator=(const PooledFuture&);
+
+    T _take(std::false_type);
+    void _take(std::true_type);
+
+    FutureState<T>* _state;
+};
+
+template<typename T>
+class PooledPromise {
+public:
+    PooledPromise();
+    PooledPromise(PooledPromise&& other) noexcept;
+    PooledPromise& operator=(PooledPromise&& other) noexcept;
+    ~PooledPromise();
+
+    PooledFuture<T> get_future();
+    template<typename... U>
+    void set_value(U&&... value);
+    void set_exception(std::exception_ptr error);
+
+private:
+    PooledPromise(const PooledPromise&);
+    PooledPromise& operator=(const PooledPromise&);
+
+    FutureState<T>* _state;
+    bool _retrieved;
+    bool _satisfied;
+};
+
+template<typename T>
+PooledFuture<T>::PooledFuture() : _state(0)
+{
+}
+
+template<typename T>
+PooledFuture<T>::PooledFuture(FutureState<T>* state) : _state(state)
+{
+}
+
+template<typename T>
+PooledFuture<T>::PooledFuture(PooledFuture&& other) noexcept : _state(other._state)
+{
+    other._state = 0;
+}
+
+template<typename T>
+PooledFuture<T>& PooledFuture<T>::operator=(PooledFuture&& other) noexcept
+{
+    if (this != &other) {
+        if (_state) {
+            _state->release();
+        }
+
+        _state = other._state;
+        other._state = 0;
+    }
+
+    return *this;
+}
+
+template<typename T>
+PooledFuture<T>::~PooledFuture()
+{
+    if (_state) {
+        _state->release();
+    }
+}
+
+template<typename T>
+bool PooledFuture<T>::valid() const
+{
+    return _state != 0;
+}
+
+template<typename T>
+bool PooledFuture<T>::ready() const
+{
+    return _state && _state->ready();
+}
+
+template<typename T>
+void PooledFuture<T>::wait() const
+{
+    if (!_state) {
+        throw std::future_error(std::future_errc::no_state);
+    }
+
+    _state->wait();
+}
+
+template<typename T>
+T PooledFuture<T>::get()
+{
+    wait();
+    return _take(std::is_void<T>());
+}
+
+template<typename T>
+T PooledFuture<T>::_take(std::false_type)
+{
+    FutureState<T>* state = _state;
+    _state = 0;
+    if (state->error()) {
+        std::exception_ptr error = state->error();
+        state->release();
+        std::rethrow_exception(error);
+    }
+
+    T value(std::move(state->value()));
+    state->release();
+    return value;
+}
+
+template<typename T>
+void PooledFuture<T>::_take(std::true_type)
+{
+    FutureState<T>* state = _state;
+    _state = 0;
+    std::exception_ptr error = state->error();
+    state->release();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template<typename T>
+PooledPromise<T>::PooledPromise() : _state(FutureState<T>::create()), _retrieved(false), _satisfied(false)
+{
+}
+
+template<typename T>
+PooledPromise<T>::PooledPromise(PooledPromise&& other) noexcept : _state(other._state), _retrieved(other._retrieved), _satisfied(other._satisfied)
+{
+    other._state = 0;
+}
+
+template<typename T>
+PooledPromise<T>& PooledPromise<T>::operator=(PooledPromise&& other) noexcept
+{
+    if (this != &other) {
+        this->~PooledPromise();
+        new (this) PooledPromise(std::move(other));
+    }
+
+    return *this;
+}
+
+template<typename T>
+PooledPromise<T>::~PooledPromise()
+{
+    if (!_state) {
+        return;
+    }
+
+    if (!_satisfied) {
+        _state->set_error(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    }
+
+    if (!_retrieved) {
+        _state->release();
+    }
+
+    _state->release();
+}
+
+template<typename T>
+PooledFuture<T> PooledPromise<T>::get_future()
+{
+    if (!_state) {
+        throw std::future_error(std::future_errc::no_state);
+    }
+
+    if (_retrieved) {
+        throw std::future_error(std::future_errc::future_already_retrieved);
+    }
+
+    _retrieved = true;
+    return PooledFuture<T>(_state);
+}
+
+template<typename T>
+template<typename... U>
+void PooledPromise<T>::set_value(U&&... value)
+{
+    if (_satisfied) {
+        throw std::future_error(std::future_errc::promise_already_satisfied);
+    }
+
+    _satisfied = true;
+    _state->set_value(std::forward<U>(value)...);
+}
+
+template<typename T>
+void PooledPromise<T>::set_exception(std::exception_ptr error)
+{
+    if (_satisfied) {
+        throw std::future_error(std::future_errc::promise_already_satisfied);
+    }
+
+    _satisfied = true;
+    _state->set_error(error);
+}
+
+
+template<typename T>
+class WorkDeque {
+public:
+    WorkDeque(size_t capacity = 256);
+    ~WorkDeque();
+
+    void push(T* item);
+    T* pop();
+    T* steal();
+    bool empty() const;
+
+private:
+    WorkDeque(const WorkDeque&);
+    WorkDeque& operator=(const WorkDeque&);
+
+    struct Buffer {
+        Buffer(size_t capacity, Buffer* prev);
+        ~Buffer();
+
+        T* get(int64_t i) const;
+        void put(int64_t i, T* item);
+
+        size_t _mask;
+        std::atomic<T*>* _items;
+        Buffer* _prev;
+    };
+
+    Buffer* _grow(Buffer* buffer, int64_t bottom, int64_t top);
+
+    std::atomic<int64_t> _top;
+    char _pad[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> _bottom;
+    std::atomic<Buffer*> _buffer;
+};
+
+template<typename T>
+WorkDeque<T>::Buffer::Buffer(size_t capacity, Buffer* prev) : _mask(capacity - 1), _items(new std::atomic<T*>[capacity]), _prev(prev)
+{
+}
+
+template<typename T>
+WorkDeque<T>::Buffer::~Buffer()
+{
+    delete[] _items;
+}
+
+template<typename T>
+T* WorkDeque<T>::Buffer::get(int64_t i) const
+{
+    return _items[i & _mask].load(std::memory_order_relaxed);
+}
+
+template<typename T>
+void WorkDeque<T>::Buffer::put(int64_t i, T* item)
+{
+    _items[i & _mask].store(item, std::memory_order_relaxed);
+}
+
+template<typename T>
+WorkDeque<T>::WorkDeque(size_t capacity) : _top(0), _bottom(0)
+{
+    size_t n = 1;
+    while (n < capacity) {
+        n <<= 1;
+    }
+
+    _buffer.store(new Buffer(n, 0), std::memory_order_relaxed);
+}
+
+template<typename T>
+WorkDeque<T>::~WorkDeque()
+{
+    Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+    while (buffer) {
+        Buffer* prev = buffer->_prev;
+        delete buffer;
+        buffer = prev;
+    }
+}
+
+template<typename T>
+typename WorkDeque<T>::Buffer* WorkDeque<T>::_grow(Buffer* buffer, int64_t bottom, int64_t top)
+{
+    Buffer* bigger = new Buffer((buffer->_mask + 1) * 2, buffer);
+    for (int64_t i = top; i < bottom; ++i) {
+        bigger->put(i, buffer->get(i));
+    }
+
+    _buffer.store(bigger, std::memory_order_release);
+    return bigger;
+}
+
+template<typename T>
+void WorkDeque<T>::push(T* item)
+{
+    int64_t bottom = _bottom.load(std::memory_order_relaxed);
+    int64_t top = _top.load(std::memory_order_acquire);
+    Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+    if (bottom - top > (int64_t)buffer->_mask) {
+        buffer = _grow(buffer, bottom, top);
     }
+
+    buffer->put(bottom, item);
+    _bottom.store(bottom + 1, std::memory_order_release);
 }
+
+template<typename T>
+T* WorkDeque<T>::pop()
+{
+    int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+    Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+    _bottom.store(bottom, std::memory_order_seq_cst);
+    int64_t top = _top.load(std::memory_order_seq_cst);
+
+    if (top > bottom) {
+        _bottom.store(bottom + 1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    T* item = buffer->get(bottom);
+    if (top == bottom) {
+        if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            item = 0;
+        }
+
+        _bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return item;
+}
+
+template<typename T>
+T* WorkDeque<T>::steal()
+{
+    int64_t top = _top.load(std::memory_order_seq_cst);
+    int64_t bottom = _bottom.load(std::memory_order_seq_cst);
+    if (top >= bottom) {
+        return 0;
+    }
+
+    Buffer* buffer = _buffer.load(std::memory_order_acquire);
+    T* item = buffer->get(top);
+    if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return 0;
+    }
+
+    return item;
+}
+
+template<typename T>
+bool WorkDeque<T>::empty() const
+{
+    return _top.load(std::memory_order_relaxed) >= _bottom.load(std::memory_order_relaxed);
+}
+
+class TaskGraph;
+
+class ThreadPool {
+public:
+    enum {
+        ANY_GROUP = (size_t)-1
+    };
+
+    enum {
+        PRIORITY_HIGH,
+        PRIORITY_NORMAL,
+        PRIORITY_LOW
+    };
+
+    enum {
+        BUCKET_CNT = 32,
+        TRACE_CNT = 1 << 20
+    };
+
+    struct Group {
+        Group();
+
+        std::vector<int> cpus;
+        size_t threads;
+        bool pin;
+        int node;
+    };
+
+    struct WorkerStats {
+        size_t group;
+        uint64_t tasks;
+        uint64_t steals;
+        uint64_t busy_ns;
+        uint64_t idle_ns;
+    };
+
+    struct Snapshot {
+        std::vector<WorkerStats> workers;
+        uint64_t outside_tasks;
+        size_t queued;
+        std::vector<size_t> group_queued;
+        uint64_t wait[BUCKET_CNT];
+        uint64_t run[BUCKET_CNT];
+    };
+
+    ThreadPool(size_t threads);
+    ThreadPool(const std::vector<Group>& groups);
+
+    static std::vector<Group> numa_groups(size_t threads_per_node = 0, bool pin = false);
+
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    template<class F, class... Args>
+    auto enqueue_to(size_t group, F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    template<class F>
+    void post(F&& f);
+
+    template<class F>
+    void post_to(size_t group, F&& f);
+
+    template<class F, class... Args>
+    auto enqueue_priority(int priority, F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    template<class F>
+    void post_priority(int priority, F&& f, size_t group = ANY_GROUP);
+
+    template<class It>
+    void enqueue_batch(It first, It last, size_t group = ANY_GROUP);
+
+    template<class Range>
+    void enqueue_batch(Range&& range, size_t group = ANY_GROUP);
+
+    void set_idle_policy(size_t spins, size_t yields);
+
+    template<class F>
+    auto submit(F&& f) -> PooledFuture<typename std::result_of<F()>::type>;
+
+    template<class Index, class F>
+    void parallel_for(Index begin, Index end, F&& fn, size_t grain = 1);
+
+    template<class Index, class T, class F, class R>
+    T parallel_reduce(Index begin, Index end, T identity, F&& map, R&& reduce, size_t grain = 1);
+
+    size_t size() const;
+    size_t groups() const;
+
+    void set_metrics(bool enable);
+    Snapshot snapshot();
+    void dump(FILE* out);
+
+    void start_trace(size_t limit = TRACE_CNT);
+    void stop_trace();
+    void write_trace(FILE* out);
+
+#ifdef __cpp_impl_coroutine
+    class Schedule {
+    public:
+        Schedule(ThreadPool* pool, size_t group);
+
+        bool await_ready() const noexcept;
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept;
+
+    private:
+        ThreadPool* _pool;
+        size_t _group;
+    };
+
+    Schedule schedule(size_t group = ANY_GROUP);
+#endif
+
+    ~ThreadPool();
+
+private:
+    friend class TaskGraph;
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    enum {
+        PRIORITY_CNT = 3,
+        STARVE_CNT = 8
+    };
+
+    template<class F, class R>
+    struct Call {
+        static void run(F& f, PooledPromise<R>& promise);
+    };
+
+    template<class F>
+    struct Call<F, void> {
+        static void run(F& f, PooledPromise<void>& promise);
+    };
+
+    template<class F, class R>
+    struct Submit {
+        template<class G>
+        Submit(G&& f, PooledPromise<R>&& promise);
+
+        void operator()();
+
+        F _func;
+        PooledPromise<R> _promise;
+    };
+
+    template<class Index, class F>
+    struct ForBody {
+        typedef char Partial;
+
+        Partial identity() const;
+        void apply(Index begin, Index end, Partial& part);
+        void merge(Partial& part);
+
+        F& _fn;
+    };
+
+    template<class Index, class T, class F, class R>
+    struct ReduceBody {
+        typedef T Partial;
+
+        ReduceBody(const T& identity, F& map, R& reduce);
+
+        Partial identity() const;
+        void apply(Index begin, Index end, Partial& part);
+        void merge(Partial& part);
+
+        T _identity;
+        F& _map;
+        R& _reduce;
+        T _result;
+        std::mutex _mutex;
+    };
+
+    template<class Index, class Body>
+    class Loop {
+    public:
+        Loop(ThreadPool& pool, Body& body, size_t grain);
+
+        void run(Index begin, Index end);
+        void wait();
+
+    private:
+        ThreadPool& _pool;
+        Body& _body;
+        size_t _grain;
+        std::atomic<size_t> _jobs;
+        std::atomic<bool> _failed;
+        std::exception_ptr _error;
+        std::mutex _error_mutex;
+    };
+
+    struct Domain {
+        Domain(size_t first, size_t count);
+
+        std::mutex _queue_mutex;
+        std::condition_variable _condition;
+        std::queue<Task*> _tasks[PRIORITY_CNT];
+        std::atomic<size_t> _shared;
+        std::atomic<size_t> _urgent;
+        std::atomic<size_t> _sleeping;
+        size_t _turn;
+        size_t _first;
+        size_t _count;
+    };
+
+    struct Event {
+        uint64_t _queued;
+        uint64_t _start;
+        uint64_t _end;
+    };
+
+    struct Stats {
+        Stats();
+
+        std::atomic<uint64_t> _tasks;
+        std::atomic<uint64_t> _steals;
+        std::atomic<uint64_t> _busy;
+        std::atomic<uint64_t> _idle;
+        std::atomic<uint64_t> _wait[BUCKET_CNT];
+        std::atomic<uint64_t> _run[BUCKET_CNT];
+        std::mutex _trace_mutex;
+        std::vector<Event> _trace;
+    };
+
+    struct Worker {
+        Worker(ThreadPool* pool, size_t index, size_t group);
+
+        ThreadPool* _pool;
+        size_t _index;
+        size_t _group;
+        uint32_t _seed;
+        size_t _tick;
+        WorkDeque<Task> _deque;
+        Stats _stats;
+    };
+
+    static Worker*& _current();
+    static uint32_t& _foreign_seed();
+    static std::vector<int> _parse_cpus(const char* list);
+    static void _pin(const std::vector<int>& cpus);
+    static void _relax();
+    static uint64_t _now();
+    static size_t _bucket(uint64_t ns);
+    static void _count(std::atomic<uint64_t>& counter, uint64_t n, bool shared);
+
+    void _start(const std::vector<Group>& groups);
+    Worker* _local();
+    size_t _pick(size_t group, Worker* self);
+    void _push(Task* task, size_t group, int priority);
+    void _notify(Domain& domain, size_t n);
+    void _wake(size_t home, size_t n);
+    Task* _take(Domain& domain, bool urgent);
+    Task* _next(Worker* self);
+    Task* _steal(uint32_t& seed, Worker* self);
+    void _run(Worker& self);
+    void _execute(Worker* self, Task* task);
+    void _stamp(Task* task);
+    bool _help();
+    bool _hungry();
+
+    std::vector<std::thread> _workers;
+    std::vector<std::unique_ptr<Worker>> _queues;
+    std::vector<std::unique_ptr<Domain>> _groups;
+    std::atomic<size_t> _pending;
+    std::atomic<size_t> _shared;
+    std::atomic<size_t> _round;
+    std::atomic<size_t> _spins;
+    std::atomic<size_t> _yields;
+    std::atomic<bool> _stop;
+    std::atomic<bool> _metrics;
+    std::atomic<bool> _tracing;
+    std::atomic<size_t> _trace_limit;
+    uint64_t _trace_base;
+    Stats _outside;
+};
+
+inline ThreadPool::Group::Group() : threads(0), pin(false), node(-1)
+{
+}
+
+inline ThreadPool::Domain::Domain(size_t first, size_t count) : _shared(0), _urgent(0), _sleeping(0), _turn(0), _first(first), _count(count)
+{
+}
+
+inline ThreadPool::Stats::Stats() : _tasks(0), _steals(0), _busy(0), _idle(0)
+{
+    for (size_t i = 0; i < BUCKET_CNT; ++i) {
+        _wait[i].store(0, std::memory_order_relaxed);
+        _run[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+inline ThreadPool::Worker::Worker(ThreadPool* pool, size_t index, size_t group)
+    : _pool(pool), _index(index), _group(group), _seed((uint32_t)index * 2654435761u + 1), _tick(0)
+{
+}
+
+inline ThreadPool::ThreadPool(size_t threads) : _pending(0), _shared(0), _round(0), _spins(0), _yields(0), _stop(false),
+    _metrics(false), _tracing(false), _trace_limit(0), _trace_base(0)
+{
+    Group group;
+    group.threads = threads;
+    _start(std::vector<Group>(1, group));
+}
+
+inline ThreadPool::ThreadPool(const std::vector<Group>& groups) : _pending(0), _shared(0), _round(0), _spins(0), _yields(0), _stop(false),
+    _metrics(false), _tracing(false), _trace_limit(0), _trace_base(0)
+{
+    std::vector<Group> sized(groups.empty() ? std::vector<Group>(1) : groups);
+    for (Group& group : sized) {
+        if (group.threads == 0) {
+            group.threads = group.cpus.empty() ? std::thread::hardware_concurrency() : group.cpus.size();
+        }
+
+        if (group.threads == 0) {
+            group.threads = 1;
+        }
+    }
+
+    _start(sized);
+}
+
+inline void ThreadPool::_start(const std::vector<Group>& groups)
+{
+    for (size_t g = 0; g < groups.size(); ++g) {
+        _groups.emplace_back(new Domain(_queues.size(), groups[g].threads));
+        for (size_t i = 0; i < groups[g].threads; ++i) {
+            _queues.emplace_back(new Worker(this, _queues.size(), g));
+        }
+    }
+
+    for (size_t g = 0; g < groups.size(); ++g) {
+        const Group& group = groups[g];
+        for (size_t i = 0; i < group.threads; ++i) {
+            Worker* self = _queues[_groups[g]->_first + i].get();
+            std::vector<int> cpus = group.cpus;
+            if (group.pin && !cpus.empty()) {
+                cpus.assign(1, group.cpus[i % group.cpus.size()]);
+            }
+
+            _workers.emplace_back(
+                [this, self, cpus] {
+                    _pin(cpus);
+                    _current() = self;
+                    this->_run(*self);
+                }
+            );
+        }
+    }
+}
+
+inline std::vector<int> ThreadPool::_parse_cpus(const char* list)
+{
+    std::vector<int> cpus;
+    const char* p = list;
+    while (*p) {
+        char* end = 0;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back((int)cpu);
+        }
+
+        if (*p != ',') {
+            break;
+        }
+
+        ++p;
+    }
+
+    return cpus;
+}
+
+inline void ThreadPool::_pin(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    if (cpus.empty()) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpus;
+#endif
+}
+
+inline std::vector<ThreadPool::Group> ThreadPool::numa_groups(size_t threads_per_node, bool pin)
+{
+    std::vector<Group> groups;
+#ifdef __linux__
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir) {
+        while (struct dirent* entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9') {
+                continue;
+            }
+
+            char path[512];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+            FILE* file = fopen(path, "r");
+            if (!file) {
+                continue;
+            }
+
+            char list[4096];
+            Group group;
+            if (fgets(list, sizeof(list), file)) {
+                group.cpus = _parse_cpus(list);
+            }
+
+            fclose(file);
+            if (group.cpus.empty()) {
+                continue;
+            }
+
+            group.threads = threads_per_node ? threads_per_node : group.cpus.size();
+            group.pin = pin;
+            group.node = atoi(entry->d_name + 4);
+            groups.push_back(group);
+        }
+
+        closedir(dir);
+    }
+
+    std::sort(groups.begin(), groups.end(),
+        [](const Group& a, const Group& b) {
+            return a.node < b.node;
+        }
+    );
+#endif
+
+    if (groups.empty()) {
+        Group group;
+        group.threads = threads_per_node;
+        groups.push_back(group);
+    }
+
+    return groups;
+}
+
+inline size_t ThreadPool::size() const
+{
+    return _workers.size();
+}
+
+inline size_t ThreadPool::groups() const
+{
+    return _groups.size();
+}
+
+inline uint64_t ThreadPool::_now()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline size_t ThreadPool::_bucket(uint64_t ns)
+{
+    size_t bucket = 0;
+    while (ns > 1 && bucket < BUCKET_CNT - 1) {
+        ns >>= 1;
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+inline void ThreadPool::_count(std::atomic<uint64_t>& counter, uint64_t n, bool shared)
+{
+    if (shared) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    } else {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+}
+
+inline void ThreadPool::set_metrics(bool enable)
+{
+    _metrics.store(enable, std::memory_order_relaxed);
+}
+
+inline ThreadPool::Snapshot ThreadPool::snapshot()
+{
+    Snapshot snap;
+    snap.outside_tasks = _outside._tasks.load(std::memory_order_relaxed);
+    snap.queued = _pending.load(std::memory_order_relaxed) + _shared.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < BUCKET_CNT; ++i) {
+        snap.wait[i] = _outside._wait[i].load(std::memory_order_relaxed);
+        snap.run[i] = _outside._run[i].load(std::memory_order_relaxed);
+    }
+
+    for (std::unique_ptr<Domain>& domain : _groups) {
+        snap.group_queued.push_back(domain->_shared.load(std::memory_order_relaxed));
+    }
+
+    for (std::unique_ptr<Worker>& worker : _queues) {
+        Stats& stats = worker->_stats;
+        WorkerStats ws;
+        ws.group = worker->_group;
+        ws.tasks = stats._tasks.load(std::memory_order_relaxed);
+        ws.steals = stats._steals.load(std::memory_order_relaxed);
+        ws.busy_ns = stats._busy.load(std::memory_order_relaxed);
+        ws.idle_ns = stats._idle.load(std::memory_order_relaxed);
+        snap.workers.push_back(ws);
+
+        for (size_t i = 0; i < BUCKET_CNT; ++i) {
+            snap.wait[i] += stats._wait[i].load(std::memory_order_relaxed);
+            snap.run[i] += stats._run[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    return snap;
+}
+
+inline void ThreadPool::dump(FILE* out)
+{
+    Snapshot snap = snapshot();
+    fprintf(out, "%8s %6s %12s %12s %14s %14s\n", "worker", "group", "tasks", "steals", "busy_ns", "idle_ns");
+    for (size_t i = 0; i < snap.workers.size(); ++i) {
+        const WorkerStats& ws = snap.workers[i];
+        fprintf(out, "%8zu %6zu %12llu %12llu %14llu %14llu\n", i, ws.group,
+            (unsigned long long)ws.tasks, (unsigned long long)ws.steals,
+            (unsigned long long)ws.busy_ns, (unsigned long long)ws.idle_ns);
+    }
+
+    fprintf(out, "%8s %6s %12llu\n", "outside", "", (unsigned long long)snap.outside_tasks);
+    fprintf(out, "queued %zu, per group", snap.queued);
+    for (size_t g = 0; g < snap.group_queued.size(); ++g) {
+        fprintf(out, " %zu", snap.group_queued[g]);
+    }
+
+    fprintf(out, "\n%12s %12s %12s\n", "ns >=", "wait", "run");
+    for (size_t i = 0; i < BUCKET_CNT; ++i) {
+        if (snap.wait[i] || snap.run[i]) {
+            fprintf(out, "%12llu %12llu %12llu\n", i ? 1ULL << i : 0ULL,
+                (unsigned long long)snap.wait[i], (unsigned long long)snap.run[i]);
+        }
+    }
+}
+
+inline void ThreadPool::start_trace(size_t limit)
+{
+    _tracing.store(false, std::memory_order_release);
+    _trace_limit.store(limit, std::memory_order_relaxed);
+    for (size_t i = 0; i <= _queues.size(); ++i) {
+        Stats& stats = i < _queues.size() ? _queues[i]->_stats : _outside;
+        std::lock_guard<std::mutex> lock(stats._trace_mutex);
+        stats._trace.clear();
+    }
+
+    _trace_base = _now();
+    _metrics.store(true, std::memory_order_relaxed);
+    _tracing.store(true, std::memory_order_release);
+}
+
+inline void ThreadPool::stop_trace()
+{
+    _tracing.store(false, std::memory_order_release);
+}
+
+inline void ThreadPool::write_trace(FILE* out)
+{
+    fprintf(out, "{\"traceEvents\":[\n");
+    const char* sep = "";
+    for (size_t i = 0; i <= _queues.size(); ++i) {
+        Stats& stats = i < _queues.size() ? _queues[i]->_stats : _outside;
+        if (i < _queues.size()) {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zu,\"args\":{\"name\":\"worker %zu group %zu\"}}",
+                sep, i, i, _queues[i]->_group);
+        } else {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zu,\"args\":{\"name\":\"outside\"}}", sep, i);
+        }
+
+        sep = ",\n";
+        std::lock_guard<std::mutex> lock(stats._trace_mutex);
+        for (const Event& event : stats._trace) {
+            if (event._start < _trace_base) {
+                continue;
+            }
+
+            double wait = event._queued && event._queued <= event._start ? (event._start - event._queued) / 1000.0 : 0.0;
+            fprintf(out, "%s{\"name\":\"task\",\"ph\":\"X\",\"pid\":0,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"wait_us\":%.3f}}",
+                sep, i, (event._start - _trace_base) / 1000.0, (event._end - event._start) / 1000.0, wait);
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+}
+
+inline ThreadPool::Worker*& ThreadPool::_current()
+{
+    static thread_local Worker* worker = 0;
+    return worker;
+}
+
+inline ThreadPool::Worker* ThreadPool::_local()
+{
+    Worker* self = _current();
+    return self && self->_pool == this ? self : 0;
+}
+
+inline size_t ThreadPool::_pick(size_t group, Worker* self)
+{
+    if (group == ANY_GROUP) {
+        group = self ? self->_group : _round.fetch_add(1, std::memory_order_relaxed) % _groups.size();
+    }
+
+    if (group >= _groups.size()) {
+        throw std::out_of_range("enqueue to a missing ThreadPool group");
+    }
+
+    return group;
+}
+
+inline void ThreadPool::_push(Task* task, size_t group, int priority)
+{
+    Worker* self = _local();
+    if (priority < PRIORITY_HIGH || priority > PRIORITY_LOW) {
+        priority = PRIORITY_NORMAL;
+    }
+
+    _stamp(task);
+    if (self && group == ANY_GROUP && priority == PRIORITY_NORMAL) {
+        _pending.fetch_add(1, std::memory_order_seq_cst);
+        self->_deque.push(task);
+        _wake(self->_group, 1);
+        return;
+    }
+
+    try {
+        group = _pick(group, self);
+    } catch (...) {
+        ObjectPool<Task>::destroy(task);
+        throw;
+    }
+
+    Domain& domain = *_groups[group];
+    {
+        std::unique_lock<std::mutex> lock(domain._queue_mutex);
+
+        if(_stop) {
+            ObjectPool<Task>::destroy(task);
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+
+        domain._tasks[priority].push(task);
+        domain._shared.fetch_add(1, std::memory_order_relaxed);
+        if (priority == PRIORITY_HIGH) {
+            domain._urgent.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        _shared.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    _notify(domain, 1);
+}
+
+template<class It>
+void ThreadPool::enqueue_batch(It first, It last, size_t group)
+{
+    Worker* self = _local();
+    size_t n = 0;
+    if (self && group == ANY_GROUP) {
+        try {
+            for (; first != last; ++first, ++n) {
+                Task* task = ObjectPool<Task>::construct(std::move(*first));
+                _stamp(task);
+                _pending.fetch_add(1, std::memory_order_seq_cst);
+                self->_deque.push(task);
+            }
+        } catch (...) {
+            _wake(self->_group, n);
+            throw;
+        }
+
+        _wake(self->_group, n);
+        return;
+    }
+
+    Domain& domain = *_groups[_pick(group, self)];
+    try {
+        std::unique_lock<std::mutex> lock(domain._queue_mutex);
+
+        if(_stop)
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+
+        for (; first != last; ++first, ++n) {
+            Task* task = ObjectPool<Task>::construct(std::move(*first));
+            _stamp(task);
+            domain._tasks[PRIORITY_NORMAL].push(task);
+            domain._shared.fetch_add(1, std::memory_order_relaxed);
+            _shared.fetch_add(1, std::memory_order_relaxed);
+        }
+    } catch (...) {
+        _notify(domain, n);
+        throw;
+    }
+
+    _notify(domain, n);
+}
+
+template<class Range>
+void ThreadPool::enqueue_batch(Range&& range, size_t group)
+{
+    enqueue_batch(std::begin(range), std::end(range), group);
+}
+
+inline void ThreadPool::_notify(Domain& domain, size_t n)
+{
+    size_t sleeping = domain._sleeping.load(std::memory_order_relaxed);
+    if (n >= sleeping) {
+        if (sleeping > 0) {
+            domain._condition.notify_all();
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        domain._condition.notify_one();
+    }
+}
+
+inline void ThreadPool::_wake(size_t home, size_t n)
+{
+    size_t count = _groups.size();
+    for (size_t i = 0; i < count && n > 0; ++i) {
+        Domain& domain = *_groups[(home + i) % count];
+        size_t sleeping = domain._sleeping.load(std::memory_order_seq_cst);
+        if (sleeping > 0) {
+            {
+                std::unique_lock<std::mutex> lock(domain._queue_mutex);
+            }
+            _notify(domain, n);
+            n -= n < sleeping ? n : sleeping;
+        }
+    }
+}
+
+inline void ThreadPool::set_idle_policy(size_t spins, size_t yields)
+{
+    _spins.store(spins, std::memory_order_relaxed);
+    _yields.store(yields, std::memory_order_relaxed);
+}
+
+inline void ThreadPool::_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+inline uint32_t& ThreadPool::_foreign_seed()
+{
+    static thread_local uint32_t seed = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    return seed;
+}
+
+inline Task* ThreadPool::_steal(uint32_t& seed, Worker* self)
+{
+    size_t count = _queues.size();
+    if (count == 0 || _pending.load(std::memory_order_relaxed) == 0) {
+        return 0;
+    }
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    if (self) {
+        Domain& home = *_groups[self->_group];
+        size_t start = seed % home._count;
+        for (size_t i = 0; i < home._count; ++i) {
+            Worker& victim = *_queues[home._first + (start + i) % home._count];
+            Task* task = &victim == self ? 0 : victim._deque.steal();
+            if (task) {
+                return task;
+            }
+        }
+    }
+
+    size_t start = seed % count;
+    for (size_t i = 0; i < count; ++i) {
+        Worker& victim = *_queues[(start + i) % count];
+        if (self && victim._group == self->_group) {
+            continue;
+        }
+
+        Task* task = victim._deque.steal();
+        if (task) {
+            return task;
+        }
+    }
+
+    return 0;
+}
+
+inline Task* ThreadPool::_take(Domain& domain, bool urgent)
+{
+    if ((urgent ? domain._urgent : domain._shared).load(std::memory_order_relaxed) == 0) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(domain._queue_mutex);
+    int level = 0;
+    while (level < PRIORITY_CNT && domain._tasks[level].empty()) {
+        ++level;
+    }
+
+    if (level == PRIORITY_CNT || (urgent && level != PRIORITY_HIGH)) {
+        return 0;
+    }
+
+    if (++domain._turn % STARVE_CNT == 0) {
+        level = PRIORITY_CNT - 1;
+        while (domain._tasks[level].empty()) {
+            --level;
+        }
+    }
+
+    Task* task = domain._tasks[level].front();
+    domain._tasks[level].pop();
+    domain._shared.fetch_sub(1, std::memory_order_relaxed);
+    if (level == PRIORITY_HIGH) {
+        domain._urgent.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    _shared.fetch_sub(1, std::memory_order_relaxed);
+    return task;
+}
+
+inline Task* ThreadPool::_next(Worker* self)
+{
+    Task* task = 0;
+    if (self && ++self->_tick % STARVE_CNT != 0) {
+        task = _take(*_groups[self->_group], true);
+        if (task) {
+            return task;
+        }
+    }
+
+    task = self ? self->_deque.pop() : 0;
+    if (task) {
+        _pending.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+    }
+
+    if (self) {
+        task = _take(*_groups[self->_group], false);
+    } else if (_shared.load(std::memory_order_relaxed) > 0) {
+        for (size_t i = 0; i < _groups.size() && !task; ++i) {
+            task = _take(*_groups[i], false);
+        }
+    }
+
+    if (task) {
+        return task;
+    }
+
+    task = _steal(self ? self->_seed : _foreign_seed(), self);
+    if (task) {
+        _pending.fetch_sub(1, std::memory_order_relaxed);
+        _count(self ? self->_stats._steals : _outside._steals, 1, !self);
+    }
+
+    return task;
+}
+
+inline void ThreadPool::_run(Worker& self)
+{
+    size_t idle = 0;
+    uint64_t idle_since = 0;
+    for (;;) {
+        Task* task = _next(&self);
+        if (task) {
+            if (idle_since) {
+                _count(self._stats._idle, _now() - idle_since, false);
+                idle_since = 0;
+            }
+
+            _execute(&self, task);
+            idle = 0;
+            continue;
+        }
+
+        if (!idle_since && _metrics.load(std::memory_order_relaxed)) {
+            idle_since = _now();
+        }
+
+        size_t spins = _spins.load(std::memory_order_relaxed);
+        if (idle < spins + _yields.load(std::memory_order_relaxed)) {
+            if (idle++ < spins) {
+                _relax();
+            } else {
+                std::this_thread::yield();
+            }
+
+            continue;
+        }
+
+        idle = 0;
+        Domain& home = *_groups[self._group];
+        std::unique_lock<std::mutex> lock(home._queue_mutex);
+        home._sleeping.fetch_add(1, std::memory_order_seq_cst);
+        home._condition.wait(lock,
+            [this, &home] {
+                return this->_stop || this->_pending.load(std::memory_order_seq_cst) > 0 || home._shared.load(std::memory_order_relaxed) > 0;
+            }
+        );
+        home._sleeping.fetch_sub(1, std::memory_order_relaxed);
+
+        if (this->_stop && this->_pending.load(std::memory_order_seq_cst) == 0 && home._shared.load(std::memory_order_relaxed) == 0) {
+            if (idle_since) {
+                _count(self._stats._idle, _now() - idle_since, false);
+            }
+
+            return;
+        }
+    }
+}
+
+inline void ThreadPool::_execute(Worker* self, Task* task)
+{
+    Stats& stats = self ? self->_stats : _outside;
+    bool metrics = _metrics.load(std::memory_order_relaxed);
+    uint64_t queued = task->_queued;
+    uint64_t start = metrics ? _now() : 0;
+    try {
+        (*task)();
+    } catch (...) {
+        std::terminate();
+    }
+
+    uint64_t end = metrics ? _now() : 0;
+    ObjectPool<Task>::destroy(task);
+
+    _count(stats._tasks, 1, !self);
+    if (!metrics) {
+        return;
+    }
+
+    _count(stats._busy, end - start, !self);
+    _count(stats._run[_bucket(end - start)], 1, !self);
+    if (queued && queued <= start) {
+        _count(stats._wait[_bucket(start - queued)], 1, !self);
+    }
+
+    if (_tracing.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(stats._trace_mutex);
+        if (stats._trace.size() < _trace_limit.load(std::memory_order_relaxed)) {
+            Event event = { queued, start, end };
+            stats._trace.push_back(event);
+        }
+    }
+}
+
+inline void ThreadPool::_stamp(Task* task)
+{
+    task->_queued = _metrics.load(std::memory_order_relaxed) ? _now() : 0;
+}
+
+inline bool ThreadPool::_help()
+{
+    Worker* self = _local();
+    Task* task = _next(self);
+    if (!task) {
+        return false;
+    }
+
+    _execute(self, task);
+    return true;
+}
+
+inline bool ThreadPool::_hungry()
+{
+    Worker* self = _current();
+    if (self && self->_pool == this) {
+        return self->_deque.empty();
+    }
+
+    return _shared.load(std::memory_order_relaxed) == 0;
+}
+
+template<class F, class... Args>
+auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    return enqueue_to(ANY_GROUP, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+auto ThreadPool::enqueue_to(size_t group, F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    using return_type = typename std::result_of<F(Args...)>::type;
+
+    auto task = std::make_shared<std::packaged_task<return_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+
+    std::future<return_type> res = task->get_future();
+    post_to(group,
+        [task] {
+            (*task)();
+        }
+    );
+
+    return res;
+}
+
+template<class F, class... Args>
+auto ThreadPool::enqueue_priority(int priority, F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    using return_type = typename std::result_of<F(Args...)>::type;
+
+    auto task = std::make_shared<std::packaged_task<return_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+
+    std::future<return_type> res = task->get_future();
+    post_priority(priority,
+        [task] {
+            (*task)();
+        }
+    );
+
+    return res;
+}
+
+template<class F>
+void ThreadPool::post(F&& f)
+{
+    _push(ObjectPool<Task>::construct(std::forward<F>(f)), ANY_GROUP, PRIORITY_NORMAL);
+}
+
+template<class F>
+void ThreadPool::post_to(size_t group, F&& f)
+{
+    _push(ObjectPool<Task>::construct(std::forward<F>(f)), group, PRIORITY_NORMAL);
+}
+
+template<class F>
+void ThreadPool::post_priority(int priority, F&& f, size_t group)
+{
+    _push(ObjectPool<Task>::construct(std::forward<F>(f)), group, priority);
+}
+
+template<class F, class R>
+void ThreadPool::Call<F, R>::run(F& f, PooledPromise<R>& promise)
+{
+    try {
+        promise.set_value(f());
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+    }
+}
+
+template<class F>
+void ThreadPool::Call<F, void>::run(F& f, PooledPromise<void>& promise)
+{
+    try {
+        f();
+        promise.set_value();
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+    }
+}
+
+template<class F, class R>
+template<class G>
+ThreadPool::Submit<F, R>::Submit(G&& f, PooledPromise<R>&& promise) : _func(std::forward<G>(f)), _promise(std::move(promise))
+{
+}
+
+template<class F, class R>
+void ThreadPool::Submit<F, R>::operator()()
+{
+    Call<F, R>::run(_func, _promise);
+}
+
+template<class F>
+auto ThreadPool::submit(F&& f) -> PooledFuture<typename std::result_of<F()>::type>
+{
+    typedef typename std::result_of<F()>::type return_type;
+    typedef typename std::decay<F>::type Func;
+
+    PooledPromise<return_type> promise;
+    PooledFuture<return_type> res = promise.get_future();
+    post(Submit<Func, return_type>(std::forward<F>(f), std::move(promise)));
+
+    return res;
+}
+
+template<class Index, class F>
+typename ThreadPool::ForBody<Index, F>::Partial ThreadPool::ForBody<Index, F>::identity() const
+{
+    return 0;
+}
+
+template<class Index, class F>
+void ThreadPool::ForBody<Index, F>::apply(Index begin, Index end, Partial&)
+{
+    for (Index i = begin; i < end; ++i) {
+        _fn(i);
+    }
+}
+
+template<class Index, class F>
+void ThreadPool::ForBody<Index, F>::merge(Partial&)
+{
+}
+
+template<class Index, class T, class F, class R>
+ThreadPool::ReduceBody<Index, T, F, R>::ReduceBody(const T& identity, F& map, R& reduce)
+    : _identity(identity), _map(map), _reduce(reduce), _result(identity)
+{
+}
+
+template<class Index, class T, class F, class R>
+typename ThreadPool::ReduceBody<Index, T, F, R>::Partial ThreadPool::ReduceBody<Index, T, F, R>::identity() const
+{
+    return _identity;
+}
+
+template<class Index, class T, class F, class R>
+void ThreadPool::ReduceBody<Index, T, F, R>::apply(Index begin, Index end, Partial& part)
+{
+    for (Index i = begin; i < end; ++i) {
+        part = _reduce(std::move(part), _map(i));
+    }
+}
+
+template<class Index, class T, class F, class R>
+void ThreadPool::ReduceBody<Index, T, F, R>::merge(Partial& part)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _result = _reduce(std::move(_result), std::move(part));
+}
+
+template<class Index, class Body>
+ThreadPool::Loop<Index, Body>::Loop(ThreadPool& pool, Body& body, size_t grain)
+    : _pool(pool), _body(body), _grain(grain ? grain : 1), _jobs(1), _failed(false)
+{
+}
+
+template<class Index, class Body>
+void ThreadPool::Loop<Index, Body>::run(Index begin, Index end)
+{
+    try {
+        typename Body::Partial part = _body.identity();
+        while ((size_t)(end - begin) > _grain && !_failed.load(std::memory_order_relaxed)) {
+            if (_pool._hungry()) {
+                Index mid = begin + (end - begin) / 2;
+                _jobs.fetch_add(1, std::memory_order_relaxed);
+                try {
+                    _pool.post(
+                        [this, mid, end] {
+                            this->run(mid, end);
+                        }
+                    );
+                } catch (...) {
+                    _jobs.fetch_sub(1, std::memory_order_relaxed);
+                    throw;
+                }
+
+                end = mid;
+            } else {
+                Index stop = begin + (Index)_grain;
+                _body.apply(begin, stop, part);
+                begin = stop;
+            }
+        }
+
+        if (!_failed.load(std::memory_order_relaxed)) {
+            _body.apply(begin, end, part);
+            _body.merge(part);
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(_error_mutex);
+        if (!_error) {
+            _error = std::current_exception();
+        }
+
+        _failed.store(true, std::memory_order_relaxed);
+    }
+
+    _jobs.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+template<class Index, class Body>
+void ThreadPool::Loop<Index, Body>::wait()
+{
+    while (_jobs.load(std::memory_order_acquire) > 0) {
+        if (!_pool._help()) {
+            std::this_thread::yield();
+        }
+    }
+
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+template<class Index, class F>
+void ThreadPool::parallel_for(Index begin, Index end, F&& fn, size_t grain)
+{
+    if (!(begin < end)) {
+        return;
+    }
+
+    ForBody<Index, F> body = { fn };
+    Loop<Index, ForBody<Index, F> > loop(*this, body, grain);
+    loop.run(begin, end);
+    loop.wait();
+}
+
+template<class Index, class T, class F, class R>
+T ThreadPool::parallel_reduce(Index begin, Index end, T identity, F&& map, R&& reduce, size_t grain)
+{
+    if (!(begin < end)) {
+        return identity;
+    }
+
+    ReduceBody<Index, T, F, R> body(identity, map, reduce);
+    Loop<Index, ReduceBody<Index, T, F, R> > loop(*this, body, grain);
+    loop.run(begin, end);
+    loop.wait();
+    return std::move(body._result);
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    _stop = true;
+    for (std::unique_ptr<Domain>& domain : _groups) {
+        {
+            std::unique_lock<std::mutex> lock(domain->_queue_mutex);
+        }
+        domain->_condition.notify_all();
+    }
+
+    for (std::thread& worker : _workers) {
+        worker.join();
+    }
+}
+
+class TaskGraph {
+public:
+    TaskGraph();
+
+    template<class F>
+    size_t add(F&& fn);
+    void precede(size_t before, size_t after);
+
+    void run(ThreadPool& pool);
+
+    size_t size() const;
+    void clear();
+
+private:
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator=(const TaskGraph&);
+
+    struct Node {
+        std::function<void()> _fn;
+        std::vector<size_t> _successors;
+        size_t _predecessors;
+        std::atomic<size_t> _count;
+    };
+
+    enum {
+        NONE = (size_t)-1
+    };
+
+    void _check();
+    void _post(size_t index);
+    void _execute(size_t index);
+
+    std::vector<std::unique_ptr<Node>> _nodes;
+    bool _checked;
+    ThreadPool* _pool;
+    std::atomic<size_t> _remaining;
+    std::atomic<bool> _failed;
+    std::exception_ptr _error;
+    std::mutex _error_mutex;
+};
+
+inline TaskGraph::TaskGraph() : _checked(true), _pool(0), _remaining(0), _failed(false)
+{
+}
+
+template<class F>
+size_t TaskGraph::add(F&& fn)
+{
+    std::unique_ptr<Node> node(new Node());
+    node->_fn = std::forward<F>(fn);
+    node->_predecessors = 0;
+    _nodes.push_back(std::move(node));
+    return _nodes.size() - 1;
+}
+
+inline void TaskGraph::precede(size_t before, size_t after)
+{
+    if (before >= _nodes.size() || after >= _nodes.size()) {
+        throw std::out_of_range("TaskGraph::precede");
+    }
+
+    _nodes[before]->_successors.push_back(after);
+    ++_nodes[after]->_predecessors;
+    _checked = false;
+}
+
+inline size_t TaskGraph::size() const
+{
+    return _nodes.size();
+}
+
+inline void TaskGraph::clear()
+{
+    _nodes.clear();
+    _checked = true;
+}
+
+inline void TaskGraph::_check()
+{
+    if (_checked) {
+        return;
+    }
+
+    std::vector<size_t> count(_nodes.size());
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        count[i] = _nodes[i]->_predecessors;
+        if (count[i] == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    size_t seen = 0;
+    while (!ready.empty()) {
+        size_t i = ready.back();
+        ready.pop_back();
+        ++seen;
+        for (size_t next : _nodes[i]->_successors) {
+            if (--count[next] == 0) {
+                ready.push_back(next);
+            }
+        }
+    }
+
+    if (seen != _nodes.size()) {
+        throw std::logic_error("TaskGraph has a cycle");
+    }
+
+    _checked = true;
+}
+
+inline void TaskGraph::_post(size_t index)
+{
+    try {
+        _pool->post(
+            [this, index] {
+                this->_execute(index);
+            }
+        );
+    } catch (...) {
+        _execute(index);
+    }
+}
+
+inline void TaskGraph::_execute(size_t index)
+{
+    for (;;) {
+        Node& node = *_nodes[index];
+        if (!_failed.load(std::memory_order_relaxed)) {
+            try {
+                node._fn();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(_error_mutex);
+                if (!_error) {
+                    _error = std::current_exception();
+                }
+
+                _failed.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        size_t next = NONE;
+        for (size_t succ : node._successors) {
+            if (_nodes[succ]->_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (next == NONE) {
+                    next = succ;
+                } else {
+                    _post(succ);
+                }
+            }
+        }
+
+        _remaining.fetch_sub(1, std::memory_order_acq_rel);
+        if (next == NONE) {
+            return;
+        }
+
+        index = next;
+    }
+}
+
+inline void TaskGraph::run(ThreadPool& pool)
+{
+    if (_nodes.empty()) {
+        return;
+    }
+
+    _check();
+    _pool = &pool;
+    _error = std::exception_ptr();
+    _failed.store(false, std::memory_order_relaxed);
+    _remaining.store(_nodes.size(), std::memory_order_relaxed);
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        _nodes[i]->_count.store(_nodes[i]->_predecessors, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        if (_nodes[i]->_predecessors == 0) {
+            _post(i);
+        }
+    }
+
+    while (_remaining.load(std::memory_order_acquire) > 0) {
+        if (!pool._help()) {
+            std::this_thread::yield();
+        }
+    }
+
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+#ifdef __cpp_impl_coroutine
+inline ThreadPool::Schedule::Schedule(ThreadPool* pool, size_t group) : _pool(pool), _group(group)
+{
+}
+
+inline bool ThreadPool::Schedule::await_ready() const noexcept
+{
+    return false;
+}
+
+inline void ThreadPool::Schedule::await_suspend(std::coroutine_handle<> handle)
+{
+    _pool->post_to(_group,
+        [handle] {
+            handle.resume();
+        }
+    );
+}
+
+inline void ThreadPool::Schedule::await_resume() const noexcept
+{
+}
+
+inline ThreadPool::Schedule ThreadPool::schedule(size_t group)
+{
+    return Schedule(this, group);
+}
+
+class CoPromiseBase {
+public:
+    struct Final {
+        bool await_ready() const noexcept;
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept;
+        void await_resume() const noexcept;
+    };
+
+    CoPromiseBase();
+
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+    std::suspend_always initial_suspend() const noexcept;
+    Final final_suspend() const noexcept;
+    void unhandled_exception();
+
+    void continue_with(std::coroutine_handle<> handle);
+
+protected:
+    std::coroutine_handle<> _continuation;
+    std::exception_ptr _error;
+};
+
+template<typename T>
+class CoPromise : public CoPromiseBase {
+public:
+    CoPromise();
+    ~CoPromise();
+
+    template<typename U>
+    void return_value(U&& value);
+    T result();
+
+private:
+    bool _has_value;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type _value;
+};
+
+template<>
+class CoPromise<void> : public CoPromiseBase {
+public:
+    void return_void();
+    void result();
+};
+
+template<typename T = void>
+class CoTask {
+public:
+    struct promise_type : public CoPromise<T> {
+        CoTask get_return_object();
+    };
+
+    struct Awaiter {
+        bool await_ready() const noexcept;
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) noexcept;
+        T await_resume();
+
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+    struct Ready {
+        bool await_ready() const noexcept;
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) noexcept;
+        void await_resume() const noexcept;
+
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+    CoTask();
+    CoTask(CoTask&& other) noexcept;
+    CoTask& operator=(CoTask&& other) noexcept;
+    ~CoTask();
+
+    bool valid() const;
+    bool done() const;
+
+    Awaiter operator co_await() const noexcept;
+    Ready when_ready() const noexcept;
+
+private:
+    explicit CoTask(std::coroutine_handle<promise_type> handle);
+    CoTask(const CoTask&);
+    CoTask& operator=(const CoTask&);
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+struct CoDetached {
+    struct promise_type {
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+
+        CoDetached get_return_object() const noexcept;
+        std::suspend_never initial_suspend() const noexcept;
+        std::suspend_never final_suspend() const noexcept;
+        void return_void() const noexcept;
+        void unhandled_exception() const noexcept;
+    };
+
+    template<typename T>
+    static CoDetached signal(const CoTask<T>& task, PooledPromise<T> promise);
+};
+
+inline bool CoPromiseBase::Final::await_ready() const noexcept
+{
+    return false;
+}
+
+template<typename P>
+std::coroutine_handle<> CoPromiseBase::Final::await_suspend(std::coroutine_handle<P> handle) noexcept
+{
+    return static_cast<CoPromiseBase&>(handle.promise())._continuation;
+}
+
+inline void CoPromiseBase::Final::await_resume() const noexcept
+{
+}
+
+inline CoPromiseBase::CoPromiseBase() : _continuation(std::noop_coroutine())
+{
+}
+
+inline void* CoPromiseBase::operator new(size_t size)
+{
+    void* p = Allocator<16>::alloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+inline void CoPromiseBase::operator delete(void* p)
+{
+    Allocator<16>::free(p);
+}
+
+inline std::suspend_always CoPromiseBase::initial_suspend() const noexcept
+{
+    return std::suspend_always();
+}
+
+inline CoPromiseBase::Final CoPromiseBase::final_suspend() const noexcept
+{
+    return Final();
+}
+
+inline void CoPromiseBase::unhandled_exception()
+{
+    _error = std::current_exception();
+}
+
+inline void CoPromiseBase::continue_with(std::coroutine_handle<> handle)
+{
+    _continuation = handle;
+}
+
+template<typename T>
+CoPromise<T>::CoPromise() : _has_value(false)
+{
+}
+
+template<typename T>
+CoPromise<T>::~CoPromise()
+{
+    if (_has_value) {
+        ((T*)&_value)->~T();
+    }
+}
+
+template<typename T>
+template<typename U>
+void CoPromise<T>::return_value(U&& value)
+{
+    new (&_value) T(std::forward<U>(value));
+    _has_value = true;
+}
+
+template<typename T>
+T CoPromise<T>::result()
+{
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+
+    return std::move(*(T*)&_value);
+}
+
+inline void CoPromise<void>::return_void()
+{
+}
+
+inline void CoPromise<void>::result()
+{
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+template<typename T>
+CoTask<T> CoTask<T>::promise_type::get_return_object()
+{
+    return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+}
+
+template<typename T>
+bool CoTask<T>::Awaiter::await_ready() const noexcept
+{
+    return !_handle || _handle.done();
+}
+
+template<typename T>
+std::coroutine_handle<> CoTask<T>::Awaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    _handle.promise().continue_with(handle);
+    return _handle;
+}
+
+template<typename T>
+T CoTask<T>::Awaiter::await_resume()
+{
+    if (!_handle) {
+        throw std::future_error(std::future_errc::no_state);
+    }
+
+    return _handle.promise().result();
+}
+
+template<typename T>
+bool CoTask<T>::Ready::await_ready() const noexcept
+{
+    return !_handle || _handle.done();
+}
+
+template<typename T>
+std::coroutine_handle<> CoTask<T>::Ready::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    _handle.promise().continue_with(handle);
+    return _handle;
+}
+
+template<typename T>
+void CoTask<T>::Ready::await_resume() const noexcept
+{
+}
+
+template<typename T>
+CoTask<T>::CoTask() : _handle(0)
+{
+}
+
+template<typename T>
+CoTask<T>::CoTask(std::coroutine_handle<promise_type> handle) : _handle(handle)
+{
+}
+
+template<typename T>
+CoTask<T>::CoTask(CoTask&& other) noexcept : _handle(other._handle)
+{
+    other._handle = 0;
+}
+
+template<typename T>
+CoTask<T>& CoTask<T>::operator=(CoTask&& other) noexcept
+{
+    if (this != &other) {
+        if (_handle) {
+            _handle.destroy();
+        }
+
+        _handle = other._handle;
+        other._handle = 0;
+    }
+
+    return *this;
+}
+
+template<typename T>
+CoTask<T>::~CoTask()
+{
+    if (_handle) {
+        _handle.destroy();
+    }
+}
+
+template<typename T>
+bool CoTask<T>::valid() const
+{
+    return (bool)_handle;
+}
+
+template<typename T>
+bool CoTask<T>::done() const
+{
+    return _handle && _handle.done();
+}
+
+template<typename T>
+typename CoTask<T>::Awaiter CoTask<T>::operator co_await() const noexcept
+{
+    return Awaiter{_handle};
+}
+
+template<typename T>
+typename CoTask<T>::Ready CoTask<T>::when_ready() const noexcept
+{
+    return Ready{_handle};
+}
+
+inline void* CoDetached::promise_type::operator new(size_t size)
+{
+    return CoPromiseBase::operator new(size);
+}
+
+inline void CoDetached::promise_type::operator delete(void* p)
+{
+    CoPromiseBase::operator delete(p);
+}
+
+inline CoDetached CoDetached::promise_type::get_return_object() const noexcept
+{
+    return CoDetached();
+}
+
+inline std::suspend_never CoDetached::promise_type::initial_suspend() const noexcept
+{
+    return std::suspend_never();
+}
+
+inline std::suspend_never CoDetached::promise_type::final_suspend() const noexcept
+{
+    return std::suspend_never();
+}
+
+inline void CoDetached::promise_type::return_void() const noexcept
+{
+}
+
+inline void CoDetached::promise_type::unhandled_exception() const noexcept
+{
+    std::terminate();
+}
+
+template<typename T>
+class CoJoin {
+public:
+    CoJoin(std::vector<CoTask<T>>& tasks);
+
+    bool await_ready() const noexcept;
+    bool await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept;
+
+private:
+    static CoDetached _start(const CoTask<T>& task, CoJoin* join);
+
+    std::vector<CoTask<T>>& _tasks;
+    std::atomic<size_t> _count;
+    std::coroutine_handle<> _parent;
+};
+
+template<typename T>
+CoJoin<T>::CoJoin(std::vector<CoTask<T>>& tasks) : _tasks(tasks), _count(tasks.size() + 1)
+{
+}
+
+template<typename T>
+bool CoJoin<T>::await_ready() const noexcept
+{
+    return _tasks.empty();
+}
+
+template<typename T>
+bool CoJoin<T>::await_suspend(std::coroutine_handle<> handle)
+{
+    _parent = handle;
+    for (size_t i = 0; i < _tasks.size(); ++i) {
+        _start(_tasks[i], this);
+    }
+
+    return _count.fetch_sub(1, std::memory_order_acq_rel) > 1;
+}
+
+template<typename T>
+void CoJoin<T>::await_resume() const noexcept
+{
+}
+
+template<typename T>
+CoDetached CoJoin<T>::_start(const CoTask<T>& task, CoJoin* join)
+{
+    co_await task.when_ready();
+    if (join->_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        join->_parent.resume();
+    }
+}
+
+template<typename T>
+CoTask<std::vector<T>> when_all(std::vector<CoTask<T>> tasks)
+{
+    co_await CoJoin<T>(tasks);
+
+    std::vector<T> results;
+    results.reserve(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        results.push_back(co_await tasks[i]);
+    }
+
+    co_return results;
+}
+
+inline CoTask<void> when_all(std::vector<CoTask<void>> tasks)
+{
+    co_await CoJoin<void>(tasks);
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        co_await tasks[i];
+    }
+}
+
+template<typename T>
+CoDetached CoDetached::signal(const CoTask<T>& task, PooledPromise<T> promise)
+{
+    try {
+        if constexpr (std::is_void<T>::value) {
+            co_await task;
+            promise.set_value();
+        } else {
+            promise.set_value(co_await task);
+        }
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+    }
+}
+
+template<typename T>
+T sync_wait(CoTask<T> task)
+{
+    PooledPromise<T> promise;
+    PooledFuture<T> future = promise.get_future();
+    CoDetached::signal(task, std::move(promise));
+    return future.get();
+}
+#endif
 #endif